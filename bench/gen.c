@@ -0,0 +1,120 @@
+// Synthetic program generator for benchmarking imp.
+//
+// Usage: gen [-n procs] [-c calls] [-g shape] [-b bytes] [-s seed]
+//
+// Writes a program of PROCS procedures p0..pN-1 plus a main that calls
+// p0 to stdout. Every body makes CALLS calls, picked according to SHAPE:
+//   random  any procedure, recursion included
+//   dag     only higher numbered procedures, so the graph is acyclic
+//   chain   the next procedure, one long chain
+//   tree    the children of a CALLS-ary tree rooted at p0
+// With -b, the procedure count is picked so the output is roughly BYTES
+// and -n is ignored.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef enum {
+    SHAPE_RANDOM,
+    SHAPE_DAG,
+    SHAPE_CHAIN,
+    SHAPE_TREE
+} Shape;
+
+static uint64_t rng_state = 88172645463325252ull;
+
+// xorshift64
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [-n procs] [-c calls] [-g random|dag|chain|tree] "
+            "[-b bytes] [-s seed]\n",
+            program);
+    exit(1);
+}
+
+// Callee of call J in procedure I, or -1 for none.
+static long pick_callee(Shape shape, long i, long j, long procs, long calls) {
+    switch (shape) {
+    case SHAPE_RANDOM:
+        return rng_next() % procs;
+    case SHAPE_DAG:
+        return i + 1 < procs ? i + 1 + (long)(rng_next() % (procs - i - 1)) : -1;
+    case SHAPE_CHAIN:
+        return j == 0 && i + 1 < procs ? i + 1 : -1;
+    case SHAPE_TREE: {
+        long child = i * calls + j + 1;
+        return child < procs ? child : -1;
+    }
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    long procs = 10000;
+    long calls = 4;
+    long bytes = 0;
+    Shape shape = SHAPE_RANDOM;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        const char *value = argv[++i];
+        if (strcmp(argv[i - 1], "-n") == 0) {
+            procs = atol(value);
+        } else if (strcmp(argv[i - 1], "-c") == 0) {
+            calls = atol(value);
+        } else if (strcmp(argv[i - 1], "-b") == 0) {
+            bytes = atol(value);
+        } else if (strcmp(argv[i - 1], "-s") == 0) {
+            rng_state = strtoull(value, NULL, 10) | 1;
+        } else if (strcmp(argv[i - 1], "-g") == 0) {
+            if (strcmp(value, "random") == 0) {
+                shape = SHAPE_RANDOM;
+            } else if (strcmp(value, "dag") == 0) {
+                shape = SHAPE_DAG;
+            } else if (strcmp(value, "chain") == 0) {
+                shape = SHAPE_CHAIN;
+            } else if (strcmp(value, "tree") == 0) {
+                shape = SHAPE_TREE;
+            } else {
+                usage(argv[0]);
+            }
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    // ~12 bytes per call and ~24 per header is close enough to turn a
+    // byte budget into a procedure count up front, which the callee
+    // picks need.
+    if (bytes > 0) {
+        procs = bytes / (24 + 12 * calls) + 1;
+    }
+    if (procs < 1 || calls < 0) {
+        usage(argv[0]);
+    }
+
+    for (long i = 0; i < procs; i++) {
+        printf("p%ld :: proc() {\n", i);
+        for (long j = 0; j < calls; j++) {
+            long callee = pick_callee(shape, i, j, procs, calls);
+            if (callee >= 0) {
+                printf("    p%ld()\n", callee);
+            }
+        }
+        printf("}\n\n");
+    }
+    printf("main :: proc() {\n    p0()\n}\n");
+
+    return 0;
+}
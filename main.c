@@ -4,17 +4,29 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <elf.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <setjmp.h>
+#include <sched.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-// TODO Tail call optimization.
 // TODO Scope of Scopes
-// TODO --return-symbol-at POINT
-// TODO Compilers should also be lsp's
 // TODO Capture tests on the buffer or region
 
-// TODO Frame pointer omission: For simple functions,
-// we could omit the frame pointer (rbp) entirely,
-// saving two instructions per function.
-
 typedef enum {
     TOKEN_IDENTIFIER,
     TOKEN_DOUBLE_COLON,
@@ -27,97 +39,484 @@ typedef enum {
 } TokenType;
 
 typedef struct {
-    size_t row;    // Current line number (1-based)
-    size_t col;    // Current column number (1-based)
     size_t point;  // Current position in source
-    size_t line;   // Current line in the buffer
 } Cursor;
 
 typedef struct {
-    char *content;   // Text content
-    size_t size;     // Current size of content
-    size_t capacity; // Allocated capacity
+    size_t row;    // Line number (1-based)
+    size_t col;    // Column number (1-based)
+    size_t line;   // Line in the buffer (0-based)
+} Position;
+
+// Allocations made for one structure, counted where they happen
+typedef struct {
+    size_t allocations;
+    size_t bytes;
+} Allocations;
+
+typedef struct {
+    size_t *starts;  // Offset of the first byte of each line
+    size_t count;    // Number of lines
+    size_t capacity;
+    Allocations allocs;
+} LineIndex;
+
+typedef struct {
+    const char *content; // Text content, not NUL terminated
+    size_t size;         // Bytes of text, not counting the gap
+    size_t capacity;     // Allocated capacity, 0 when borrowed
+    size_t gap;          // Where the capacity - size free bytes sit, content
+                         // is only contiguous while this is at size
     char *name;      // Buffer name
+    LineIndex lines;     // Kept in step with edits by buffer_replace
 } Buffer;
 
+// A change to the buffer: bytes start to old_end were replaced by what
+// is now start to new_end. Several edits merge into one covering them.
 typedef struct {
     size_t start;
-    size_t end;
-    Color bg;
-    Color fg;
+    size_t old_end;
+    size_t new_end;
+} Edit;
+
+// Colors by role rather than value, the theme current at draw time
+// decides what they look like.
+typedef enum {
+    FACE_TEXT,
+    FACE_BACKGROUND,
+    FACE_VARIABLE,
+    FACE_FUNCTION,
+    FACE_KEYWORD,
+    FACE_PREPROCESSOR,
+    FACE_TYPE,
+    NUM_FACES
+} FaceClass;
+
+typedef struct {
+    uint8_t fg; // FaceClass
+    uint8_t bg;
 } Face;
 
 typedef struct {
+    size_t start;  // Offset into Buffer.content
+    size_t length; // Length in bytes
+} Span;
+
+typedef struct {
+    Span lexeme;   // View of the token text in the buffer
     TokenType type;
-    char* lexeme;  // The actual text of the token
-    size_t row;    // Line number where token appears
-    size_t col;    // Column number where token starts
-    size_t line;   // Line of the token
     Face face;
 } Token;
 
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t capacity;
+    size_t used;
+    unsigned char data[];
+} ArenaChunk;
+
+typedef struct {
+    ArenaChunk *chunks; // Current chunk first
+    void *last;         // Most recent allocation, can grow in place
+    size_t bytes;       // Total bytes handed out
+    size_t count;       // Total allocations
+    Allocations backing; // Chunks taken from malloc or the pool
+} Arena;
+
 typedef struct {
     Token *tokens;
     size_t count;
     size_t capacity;
+    size_t expected; // Capacity of the first block
+    Arena *arena;
+    Allocations allocs;
 } TokenHistory;
 
+typedef enum {
+    RECURSION_NONE, // Not part of any call cycle
+    RECURSION_TAIL, // Every call back into its cycle is a last call
+    RECURSION_FULL  // Some call back into its cycle has to return
+} Recursion;
+
+#define STACK_UNBOUNDED SIZE_MAX
+
 typedef struct Procedure {
     char* name;               // Name of the procedure
-    struct Procedure** calls; // Array of procedures this procedure calls
+    size_t length;            // Length of the name
+    uint32_t hash;            // Hash of the name
+    size_t id;                // Index into Compiler.procedures.array
+    bool defined;             // Has a body, rather than only being called
+    bool reachable;           // Can be reached from main
+    Span definition;          // Name at the definition, in Compiler.buffer
+    Span reference;           // Name at a mention of it, for diagnostics
+    size_t num_references;    // Calls naming it in defined procedures
+    Recursion recursion;      // Set by find_sccs, cycles are never inlined
+    size_t stack_depth;       // Worst case bytes used below its return address
+    struct Procedure** calls; // Calls as parsed, Compiler.graph is the final form
     size_t num_calls;         // Number of procedure calls
     size_t calls_capacity;    // Capacity of calls array
+    Allocations calls_allocs; // Growing calls
 } Procedure;
 
 typedef struct {
     Procedure **array;
     size_t num;
     size_t capacity;
+    Allocations allocs;
 } Procedures;
 
 typedef struct {
+    Procedure **slots; // Open addressing, NULL means empty
+    size_t count;
+    size_t capacity;   // Always a power of two
+    Allocations allocs;
+} SymbolTable;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} Emitter;
+
+// Compressed sparse row call graph, one node per procedure id. The
+// calls made by procedure i are edges[offsets[i]] up to edges[offsets[i + 1]].
+typedef struct {
+    uint32_t *offsets; // num_nodes + 1 entries
+    uint32_t *edges;   // Callee ids, in call order
+    size_t num_nodes;
+    size_t num_edges;
+} CallGraph;
+
+typedef struct {
+    const char *path;    // NULL when caching is off
+    char *file;          // The last build's cache file
+    size_t file_size;
+    bool mapped;
+    uint64_t key;        // This build's, see cache_key
+    const char *output;  // The last build's output, if it had the same key
+    size_t output_size;
+    size_t hits;
+    size_t misses;
+} Cache;
+
+typedef struct {
+    size_t offset; // Position of the rel32 in Compiler.code
+    size_t target; // Id of the called procedure
+    size_t addend; // Bytes past the start of the target
+} Relocation;
+
+// Procedures first up to last, generated apart from the rest. With
+// more than one chunk each has buffers of its own, stitched together
+// in order afterwards, see generate_chunks.
+typedef struct {
+    size_t first;
+    size_t last;
+    Emitter *out;         // The compiler's output, or own
+    Emitter own;
+    Relocation *relocs;   // Machine code only, offsets into out
+    size_t num_relocs;
+    size_t *addresses;    // Shared by every chunk, each sets its own ids
+} CodeChunk;
+
+// Tokens from the lexer thread to the parser, see parse_pipelined. The
+// two ends sit on cache lines of their own so they only ping-pong when
+// the ring runs empty or full.
+#define TOKEN_RING_SIZE 4096 // Power of two
+#define TOKEN_RING_ERROR UINT8_MAX
+
+typedef struct {
+    uint32_t start;
+    uint32_t length;
+    uint8_t type;  // TokenType, or TOKEN_RING_ERROR at the error point
+} RingToken;
+
+typedef struct {
+    _Alignas(64) atomic_size_t head; // Tokens written, by the lexer
+    size_t tail_seen;                // Lexer's copy of tail
+    atomic_bool stop;                // Parser gave up, lexer should too
+    const char *error_message;       // For TOKEN_RING_ERROR
+    _Alignas(64) atomic_size_t tail; // Tokens read, by the parser
+    size_t head_seen;                // Parser's copy of head
+    _Alignas(64) RingToken tokens[TOKEN_RING_SIZE];
+    Buffer *buffer;
+    size_t point;                    // Where the lexer starts
+} TokenRing;
+
+typedef struct {
+    Arena arena;       // Owns every compiler-lifetime allocation below
     Buffer buffer;
     Cursor cursor;
     Token current_token;
     Procedures procedures;
-    FILE *output_file; // Assembly output file
+    SymbolTable symbols;
+    CallGraph graph;   // Finalized calls, built by optimize()
+    Emitter output;    // Assembly output
+    Emitter code;      // Machine code output
+    size_t code_entry; // Offset of _start in code
     TokenHistory history;
+    jmp_buf *recover;  // When set, error() jumps here instead of exiting
+    size_t replay;     // Next history token lex() hands out, SIZE_MAX to scan
+    size_t loaded;     // History tokens read by load_tokens, lex() reveals them
+    TokenRing *ring;   // Where lex() takes tokens from while pipelined
+    bool streaming;    // No history, and calls go to bodies, see --stream
+    Arena bodies;      // Calls of the procedure being streamed
+    Buffer **reference_buffers; // Merged programs: the file each
+                                // Procedure.reference is in, by id
+    const char *error_message;
+    size_t error_point;
 } Compiler;
 
 bool single_highlight_mode = true;
+bool arena_recycle = false; // Keep freed chunks around for the next compiler
+int optimization_level = 0; // -O<n>, 1 turns last calls into jumps, 2 inlines
+bool keep_frame_pointer = false; // -fno-omit-frame-pointer, for perf
+size_t inline_threshold = 2;  // Inline callees making at most this many calls
+size_t inline_budget = 50;    // Growth in call sites allowed, in percent
+bool stack_report = false;    // --stack-report
+bool collect_stats = false;   // --time-report, --stats or --stats-json
+bool pipeline_lexer = true;   // Lex big files on a thread of their own, needs 2 cores
+size_t codegen_jobs = 1;      // -j, threads generating code
+const char *cache_path = NULL; // --cache <file>
 
 // Function prototypes
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+char *arena_strndup(Arena *arena, const char *str, size_t length);
+void arena_free(Arena *arena);
+void arena_reset(Arena *arena);
 Cursor cursor_new(const char* source);
 void cursor_advance(Cursor *cursor, Buffer *buffer);
+void cursor_jump(Cursor *cursor, Buffer *buffer, size_t point);
 char cursor_peek(Cursor *cursor, Buffer *buffer);
 bool cursor_is_at_end(Cursor *cursor, Buffer *buffer);
-Token token_new(TokenType type, const char *lexeme, size_t row, size_t col,
-                size_t line, size_t start, size_t end);
-Procedure* procedure_new(const char* name);
-void procedure_add_call(Procedure* proc, Procedure* called_proc);
-void procedure_free(Procedure* proc);
-Compiler* compiler_new(const char* source);
+void line_index_build(LineIndex *lines, const char *content, size_t size);
+void line_index_free(LineIndex *lines);
+Position buffer_position(Buffer *buffer, size_t point);
+void buffer_reserve(Buffer *buffer, size_t length);
+void buffer_replace(Buffer *buffer, size_t start, size_t end, const char *text, size_t length);
+void buffer_close_gap(Buffer *buffer);
+void edit_merge(Edit *edit, bool *pending, size_t start, size_t end, size_t length);
+Token token_new(TokenType type, size_t start, size_t end);
+Position token_position(Buffer *buffer, Token *token);
+const char *span_text(Buffer *buffer, Span span);
+bool span_equals(Buffer *buffer, Span span, const char *str);
+Procedure* procedure_new(Arena *arena, const char* name, size_t length);
+void procedure_add_call(Arena *arena, Procedure* proc, Procedure* called_proc);
+uint32_t hash_bytes(const char *bytes, size_t length);
+void symbol_table_init(SymbolTable *table);
+Procedure *find_procedure(Compiler *c, Span name);
+Procedure *find_procedure_named(Compiler *c, const char *name, size_t length);
+Procedure *intern_procedure(Compiler *c, Span name);
+Procedure *intern_procedure_named(Compiler *c, const char *name, size_t length);
+Compiler* compiler_new(const char* source, size_t size);
 void compiler_free(Compiler* c);
+void compiler_set_name(Compiler* c, const char* name);
 void lex(Compiler* c);
+void token_ring_pop(Compiler* c);
 void parse(Compiler* c);
+bool compiler_update(Compiler* c, Edit edit);
+void emitter_init(Emitter *e);
+void emit_bytes(Emitter *e, const char *bytes, size_t length);
+void emit_char(Emitter *e, char ch);
+bool emitter_write(Emitter *e, const char *path);
+void emitter_free(Emitter *e);
+void cache_init(Cache *cache);
+uint64_t hash64_bytes(uint64_t hash, const void *bytes, size_t length);
+uint64_t hash64_words(uint64_t hash, const void *bytes, size_t length);
+bool cache_load(Cache *cache, const char *path, uint64_t key);
+bool cache_save(Cache *cache, const char *output, size_t size);
+void cache_free(Cache *cache);
+bool read_file(const char *filename, char **content, size_t *size, bool *mapped);
+void release_file(char *content, size_t size, bool mapped);
+void call_graph_build(Arena *arena, CallGraph *graph, Procedures *procedures);
+void call_graph_reverse(Arena *arena, CallGraph *graph, CallGraph *reverse);
+bool mark_reachable(Compiler* c);
+size_t find_sccs(Compiler* c, uint32_t root, uint32_t *order, uint32_t *component);
+void inline_procedures(Compiler* c);
+bool optimize(Compiler* c);
+void analyze_stack(Compiler* c);
+void print_stack_report(Compiler* c);
 void generate_code(Compiler* c);
+bool generate_machine_code(Compiler* c);
+bool write_executable(Compiler* c, const char *path);
+bool stream_program(Compiler *c, const char *path, bool machine_code, bool mapped);
+bool stream_file(const char *path, const char *asm_file_name, bool emit_asm);
 void error(Compiler* c, const char* message);
-
-void token_history_init(TokenHistory *history);
+Token *symbol_at(Compiler* c, size_t point);
+int run_language_server(void);
+int return_symbol_at(const char *path, size_t point);
+bool dump_tokens(Compiler *c, const char *path, bool jsonl);
+bool dump_graph(Compiler *c, const char *path, bool jsonl);
+bool load_tokens(Compiler *c, const char *path);
+
+void token_history_init(TokenHistory *history, Arena *arena, size_t expected);
 void token_history_add(TokenHistory *history, Token token);
 void token_history_free(TokenHistory *history);
 
-void token_history_init(TokenHistory *history) {
+// Arena
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define ARENA_POOL_MAX 64
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+
+static ArenaChunk *arena_pool = NULL; // Recycled chunks
+static size_t arena_pool_count = 0;
+static pthread_mutex_t arena_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline void allocations_add(Allocations *a, size_t bytes) {
+    a->allocations++;
+    a->bytes += bytes;
+}
+
+void arena_init(Arena *arena) {
+    arena->chunks = NULL;
+    arena->last = NULL;
+    arena->bytes = 0;
+    arena->count = 0;
+    arena->backing = (Allocations){0};
+}
+
+static ArenaChunk *arena_chunk_new(size_t size) {
+    // Reuse the first recycled chunk that is big enough
+    if (arena_recycle) {
+        pthread_mutex_lock(&arena_pool_lock);
+        for (ArenaChunk **link = &arena_pool; *link; link = &(*link)->next) {
+            if ((*link)->capacity >= size) {
+                ArenaChunk *chunk = *link;
+                *link = chunk->next;
+                arena_pool_count--;
+                pthread_mutex_unlock(&arena_pool_lock);
+                chunk->used = 0;
+                return chunk;
+            }
+        }
+        pthread_mutex_unlock(&arena_pool_lock);
+    }
+
+    size_t capacity = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + capacity);
+    if (!chunk) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    chunk->capacity = capacity;
+    chunk->used = 0;
+#ifdef MADV_HUGEPAGE
+    // Chunks this big are the token history and other whole-program
+    // arrays, written end to end. A huge page takes one fault where 4K
+    // pages take 512.
+    if (capacity >= ARENA_HUGE_PAGE) {
+        uintptr_t first = ((uintptr_t)chunk->data + ARENA_HUGE_PAGE - 1) &
+                          ~(uintptr_t)(ARENA_HUGE_PAGE - 1);
+        uintptr_t last = ((uintptr_t)chunk->data + capacity) &
+                         ~(uintptr_t)(ARENA_HUGE_PAGE - 1);
+        if (last > first) {
+            madvise((void *)first, last - first, MADV_HUGEPAGE);
+        }
+    }
+#endif
+    return chunk;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk *chunk = arena->chunks;
+    if (!chunk || chunk->capacity - chunk->used < size) {
+        chunk = arena_chunk_new(size);
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        allocations_add(&arena->backing, sizeof(ArenaChunk) + chunk->capacity);
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->last = ptr;
+    arena->bytes += size;
+    arena->count++;
+    return ptr;
+}
+
+// Resize PTR, in place when it is the most recent allocation and the
+// chunk has room, otherwise by copying into a fresh block.
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+    if (!ptr) {
+        return arena_alloc(arena, new_size);
+    }
+
+    size_t old_aligned = (old_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    size_t new_aligned = (new_size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaChunk *chunk = arena->chunks;
+    if (ptr == arena->last &&
+        chunk->capacity - (chunk->used - old_aligned) >= new_aligned) {
+        chunk->used += new_aligned - old_aligned;
+        arena->bytes += new_aligned - old_aligned;
+        return ptr;
+    }
+
+    void *grown = arena_alloc(arena, new_size);
+    memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t length) {
+    char *copy = arena_alloc(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Release every chunk at once, into the recycle pool when arena_recycle
+// is set.
+void arena_free(Arena *arena) {
+    if (arena_recycle) {
+        pthread_mutex_lock(&arena_pool_lock);
+    }
+    ArenaChunk *chunk = arena->chunks;
+    while (chunk) {
+        ArenaChunk *next = chunk->next;
+        if (arena_recycle && arena_pool_count < ARENA_POOL_MAX) {
+            chunk->next = arena_pool;
+            arena_pool = chunk;
+            arena_pool_count++;
+        } else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+    if (arena_recycle) {
+        pthread_mutex_unlock(&arena_pool_lock);
+    }
+    arena_init(arena);
+}
+
+// Forget every allocation but keep the newest chunk for the next ones.
+// The totals keep counting.
+void arena_reset(Arena *arena) {
+    ArenaChunk *newest = arena->chunks;
+    if (!newest) {
+        return;
+    }
+    Arena older = {.chunks = newest->next};
+    arena_free(&older);
+    newest->next = NULL;
+    newest->used = 0;
+    arena->last = NULL;
+}
+
+// EXPECTED is a guess at how many tokens there will be. Getting it
+// right saves copying the history every time it doubles.
+void token_history_init(TokenHistory *history, Arena *arena, size_t expected) {
     history->tokens = NULL;
     history->count = 0;
     history->capacity = 0;
+    history->expected = expected > 8 ? expected : 8;
+    history->arena = arena;
+    history->allocs = (Allocations){0};
 }
 
+// The tokens belong to the arena, this only forgets them.
 void token_history_free(TokenHistory *history) {
-    for (size_t i = 0; i < history->count; i++) {
-        free(history->tokens[i].lexeme);
-    }
-    free(history->tokens);
     history->tokens = NULL;
     history->count = 0;
     history->capacity = 0;
@@ -125,275 +524,870 @@ void token_history_free(TokenHistory *history) {
 
 void token_history_add(TokenHistory *history, Token token) {
     if (history->count >= history->capacity) {
-        history->capacity = history->capacity == 0 ? 8 : history->capacity * 2;
-        history->tokens =
-            realloc(history->tokens, history->capacity * sizeof(Token));
+        size_t old_capacity = history->capacity;
+        history->capacity = history->capacity == 0 ? history->expected
+                                                   : history->capacity * 2;
+        history->tokens = arena_grow(history->arena, history->tokens,
+                                     old_capacity * sizeof(Token),
+                                     history->capacity * sizeof(Token));
+        allocations_add(&history->allocs, history->capacity * sizeof(Token));
     }
     history->tokens[history->count++] = token;
 }
 
+// Line index
+void line_index_build(LineIndex *lines, const char *content, size_t size) {
+    size_t capacity = 64;
+    lines->starts = malloc(capacity * sizeof(size_t));
+    lines->starts[0] = 0;
+    lines->count = 1;
+    lines->capacity = capacity;
+    lines->allocs = (Allocations){0};
+    allocations_add(&lines->allocs, capacity * sizeof(size_t));
+
+    const char *p = content;
+    const char *end = content + size;
+    const char *newline;
+    while (p < end && (newline = memchr(p, '\n', end - p))) {
+        if (lines->count >= capacity) {
+            capacity *= 2;
+            lines->starts = realloc(lines->starts, capacity * sizeof(size_t));
+            lines->capacity = capacity;
+            allocations_add(&lines->allocs, capacity * sizeof(size_t));
+        }
+        lines->starts[lines->count++] = newline + 1 - content;
+        p = newline + 1;
+    }
+}
+
+void line_index_free(LineIndex *lines) {
+    free(lines->starts);
+    lines->starts = NULL;
+    lines->count = 0;
+    lines->capacity = 0;
+}
+
+// Index of the first line starting after POINT.
+static size_t line_index_after(LineIndex *lines, size_t point) {
+    size_t lo = 0, hi = lines->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (lines->starts[mid] <= point) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Follow the replacement of START to END by LENGTH bytes of TEXT. Lines
+// that began inside the old text go, the ones TEXT starts come in and
+// everything after moves over.
+static void line_index_replace(LineIndex *lines, size_t start, size_t end,
+                               const char *text, size_t length) {
+    size_t first = line_index_after(lines, start);
+    size_t last = line_index_after(lines, end);
+    size_t added = 0;
+    for (size_t i = 0; i < length; i++) {
+        added += text[i] == '\n';
+    }
+
+    size_t count = lines->count - (last - first) + added;
+    if (count > lines->capacity) {
+        while (lines->capacity < count) {
+            lines->capacity *= 2;
+        }
+        lines->starts = realloc(lines->starts, lines->capacity * sizeof(size_t));
+        allocations_add(&lines->allocs, lines->capacity * sizeof(size_t));
+    }
+
+    memmove(lines->starts + first + added, lines->starts + last,
+            (lines->count - last) * sizeof(size_t));
+    for (size_t i = first + added; i < count; i++) {
+        lines->starts[i] = lines->starts[i] - (end - start) + length;
+    }
+    size_t k = first;
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '\n') {
+            lines->starts[k++] = start + i + 1;
+        }
+    }
+    lines->count = count;
+}
+
+// Gap buffer
+// The free space sits wherever the last edit was, so a run of nearby
+// edits only moves the bytes between them. Readers want content in one
+// piece, buffer_close_gap moves the gap back to the end before that.
+static void buffer_move_gap(Buffer *buffer, size_t point) {
+    char *data = (char *)buffer->content;
+    size_t gap_size = buffer->capacity - buffer->size;
+    if (point < buffer->gap) {
+        memmove(data + point + gap_size, data + point, buffer->gap - point);
+    } else if (point > buffer->gap) {
+        memmove(data + buffer->gap, data + buffer->gap + gap_size, point - buffer->gap);
+    }
+    buffer->gap = point;
+}
+
+// Make room for LENGTH more bytes, copying borrowed text into a buffer
+// of our own on the first call.
+void buffer_reserve(Buffer *buffer, size_t length) {
+    if (buffer->capacity > 0 && buffer->capacity - buffer->size >= length) {
+        return;
+    }
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (capacity < buffer->size + length) {
+        capacity *= 2;
+    }
+
+    if (buffer->capacity == 0) {
+        char *data = malloc(capacity);
+        memcpy(data, buffer->content, buffer->size);
+        buffer->content = data;
+        buffer->gap = buffer->size;
+    } else {
+        // Keep the text after the gap at the end of the new space
+        size_t after = buffer->size - buffer->gap;
+        char *data = realloc((char *)buffer->content, capacity);
+        memmove(data + capacity - after, data + buffer->capacity - after, after);
+        buffer->content = data;
+    }
+    buffer->capacity = capacity;
+}
+
+// Replace START to END with LENGTH bytes of TEXT.
+void buffer_replace(Buffer *buffer, size_t start, size_t end, const char *text, size_t length) {
+    buffer_reserve(buffer, length);
+    buffer_move_gap(buffer, end);
+    buffer->gap = start; // The old text joins the gap
+    buffer->size -= end - start;
+    memcpy((char *)buffer->content + start, text, length);
+    buffer->gap += length;
+    buffer->size += length;
+    line_index_replace(&buffer->lines, start, end, text, length);
+}
+
+void buffer_close_gap(Buffer *buffer) {
+    if (buffer->capacity > 0) {
+        buffer_move_gap(buffer, buffer->size);
+    }
+}
+
+// Fold the replacement of START to END by LENGTH bytes, in the text as
+// it is after EDIT, into EDIT.
+void edit_merge(Edit *edit, bool *pending, size_t start, size_t end, size_t length) {
+    if (!*pending) {
+        *edit = (Edit){.start = start, .old_end = end, .new_end = start + length};
+        *pending = true;
+        return;
+    }
+
+    // Where END was before the earlier edits
+    size_t old_end = end <= edit->start ? end :
+                     end >= edit->new_end ? end - edit->new_end + edit->old_end :
+                     edit->old_end;
+    size_t new_end = edit->new_end > end ? edit->new_end : end;
+    edit->start = start < edit->start ? start : edit->start;
+    edit->old_end = old_end > edit->old_end ? old_end : edit->old_end;
+    edit->new_end = new_end + length - (end - start);
+}
+
+// Resolve POINT to a row and column by binary search over the line starts.
+Position buffer_position(Buffer *buffer, size_t point) {
+    size_t lo = 0;
+    size_t hi = buffer->lines.count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (buffer->lines.starts[mid] <= point) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+
+    Position pos = {
+        .row = lo + 1,
+        .col = point - buffer->lines.starts[lo] + 1,
+        .line = lo
+    };
+    return pos;
+}
+
 // Cursor functions
 Cursor cursor_new(const char* source) {
+    (void)source;
     Cursor cursor = {
-        .row = 1,
-        .col = 1,
-        .point = 0,
-        .line = 0
+        .point = 0
     };
     return cursor;
 }
 
 void cursor_advance(Cursor *cursor, Buffer *buffer) {
-    if (buffer->content[cursor->point] == '\n') {
-        cursor->row++;
-        cursor->col = 1;
-        cursor->line++;
-    } else {
-        cursor->col++;
-    }
+    (void)buffer;
     cursor->point++;
 }
 
+void cursor_jump(Cursor *cursor, Buffer *buffer, size_t point) {
+    (void)buffer;
+    cursor->point = point;
+}
+
 char cursor_peek(Cursor* cursor, Buffer *buffer) {
+    if (cursor->point >= buffer->size) {
+        return '\0';
+    }
     return buffer->content[cursor->point];
 }
 
 bool cursor_is_at_end(Cursor* cursor, Buffer *buffer) {
-    return buffer->content[cursor->point] == '\0';
+    return cursor->point >= buffer->size;
 }
 
 // Token functions
-Token token_new(TokenType type, const char *lexeme, size_t row, size_t col,
-                size_t line, size_t start, size_t end) {
-    Color fg;
+Token token_new(TokenType type, size_t start, size_t end) {
+    FaceClass fg;
     switch (type) {
     case TOKEN_IDENTIFIER:
-        fg = CT.variable;
+        fg = FACE_VARIABLE;
         break;
     case TOKEN_DOUBLE_COLON:
-        fg = CT.function;
+        fg = FACE_FUNCTION;
         break;
     case TOKEN_PROC:
-        fg = CT.keyword;
+        fg = FACE_KEYWORD;
         break;
     case TOKEN_LPAREN:
     case TOKEN_RPAREN:
-        fg = CT.preprocessor;
+        fg = FACE_PREPROCESSOR;
         break;
     case TOKEN_LBRACE:
     case TOKEN_RBRACE:
-        fg = CT.type;
+        fg = FACE_TYPE;
         break;
     default:
-        fg = CT.text;
+        fg = FACE_TEXT;
     }
 
-    Face face = {.start = start, .end = end, .bg = CT.bg, .fg = fg};
+    Face face = {.fg = fg, .bg = FACE_BACKGROUND};
 
     Token token = {.type = type,
-                   .lexeme = strdup(lexeme),
-                   .row = row,
-                   .col = col,
-                   .line = line,
+                   .lexeme = {.start = start, .length = end - start},
                    .face = face};
     return token;
 }
 
+Position token_position(Buffer *buffer, Token *token) {
+    return buffer_position(buffer, token->lexeme.start);
+}
+
+// Span functions
+const char *span_text(Buffer *buffer, Span span) {
+    return buffer->content + span.start;
+}
+
+bool span_equals(Buffer *buffer, Span span, const char *str) {
+    return strncmp(span_text(buffer, span), str, span.length) == 0 &&
+           str[span.length] == '\0';
+}
+
 // Procedure functions
-Procedure* procedure_new(const char* name) {
-    Procedure* proc = malloc(sizeof(Procedure));
-    proc->name = strdup(name);
+Procedure* procedure_new(Arena *arena, const char* name, size_t length) {
+    Procedure* proc = arena_alloc(arena, sizeof(Procedure));
+    proc->name = arena_strndup(arena, name, length);
+    proc->length = length;
+    proc->hash = hash_bytes(name, length);
+    proc->id = 0;
+    proc->defined = false;
+    proc->reachable = false;
+    proc->definition = (Span){0};
+    proc->reference = (Span){0};
+    proc->num_references = 0;
+    proc->recursion = RECURSION_NONE;
+    proc->stack_depth = 0;
     proc->calls = NULL;
     proc->num_calls = 0;
     proc->calls_capacity = 0;
+    proc->calls_allocs = (Allocations){0};
     return proc;
 }
 
-void procedure_add_call(Procedure* proc, Procedure* called_proc) {
+void procedure_add_call(Arena *arena, Procedure* proc, Procedure* called_proc) {
     if (proc->num_calls >= proc->calls_capacity) {
+        size_t old_capacity = proc->calls_capacity;
         proc->calls_capacity = proc->calls_capacity == 0 ? 2 : proc->calls_capacity * 2;
-        proc->calls = realloc(proc->calls, proc->calls_capacity * sizeof(Procedure*));
+        proc->calls = arena_grow(arena, proc->calls,
+                                 old_capacity * sizeof(Procedure*),
+                                 proc->calls_capacity * sizeof(Procedure*));
+        allocations_add(&proc->calls_allocs, proc->calls_capacity * sizeof(Procedure*));
     }
     proc->calls[proc->num_calls++] = called_proc;
+    called_proc->num_references++;
+}
+
+// Symbol table
+// FNV-1a
+uint32_t hash_bytes(const char *bytes, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+void symbol_table_init(SymbolTable *table) {
+    table->slots = NULL;
+    table->count = 0;
+    table->capacity = 0;
+    table->allocs = (Allocations){0};
+}
+
+// Return the slot holding NAME, or the empty slot where it belongs.
+static Procedure **symbol_table_slot(SymbolTable *table, const char *name,
+                                     size_t length, uint32_t hash) {
+    size_t mask = table->capacity - 1;
+    size_t i = hash & mask;
+    while (table->slots[i]) {
+        Procedure *proc = table->slots[i];
+        if (proc->hash == hash && proc->length == length &&
+            memcmp(proc->name, name, length) == 0) {
+            break;
+        }
+        i = (i + 1) & mask;
+    }
+    return &table->slots[i];
 }
 
-void procedure_free(Procedure* proc) {
-    free(proc->name);
-    free(proc->calls);
-    free(proc);
+static void symbol_table_grow(SymbolTable *table, Arena *arena) {
+    Procedure **old_slots = table->slots;
+    size_t old_capacity = table->capacity;
+
+    table->capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    table->slots = arena_alloc(arena, table->capacity * sizeof(Procedure *));
+    memset(table->slots, 0, table->capacity * sizeof(Procedure *));
+    allocations_add(&table->allocs, table->capacity * sizeof(Procedure *));
+    for (size_t i = 0; i < old_capacity; i++) {
+        Procedure *proc = old_slots[i];
+        if (proc) {
+            *symbol_table_slot(table, proc->name, proc->length, proc->hash) = proc;
+        }
+    }
 }
 
 // Compiler functions
-Compiler *compiler_new(const char *source) {
+// The compiler borrows SOURCE, which must outlive it.
+Compiler *compiler_new(const char *source, size_t size) {
     Compiler *c = malloc(sizeof(Compiler));
-    c->buffer.content = strdup(source);
-    c->buffer.size = strlen(source);
-    c->buffer.capacity = c->buffer.size + 1;
-    c->buffer.name = strdup("source");
-    c->cursor.row = 1;
-    c->cursor.col = 1;
-    c->cursor.point = 0;
-    c->cursor.line = 0;
+    arena_init(&c->arena);
+    c->buffer.content = source;
+    c->buffer.size = size;
+    c->buffer.capacity = 0;
+    c->buffer.gap = size;
+    c->buffer.name = arena_strndup(&c->arena, "source", 6);
+    line_index_build(&c->buffer.lines, source, size);
+    c->cursor = cursor_new(source);
+    c->current_token = (Token){0};
     c->procedures.array = NULL;
     c->procedures.num = 0;
     c->procedures.capacity = 0;
-    c->output_file = NULL;
-    token_history_init(&c->history);
+    c->procedures.allocs = (Allocations){0};
+    symbol_table_init(&c->symbols);
+    c->graph = (CallGraph){0};
+    emitter_init(&c->output);
+    emitter_init(&c->code);
+    c->code_entry = 0;
+    // Most tokens have a space or another token's byte next to them, a
+    // denser file grows the history once more. Nothing is touched until
+    // the first token, so a streamed file never pays for it.
+    token_history_init(&c->history, &c->arena, size / 2);
+    c->recover = NULL;
+    c->replay = SIZE_MAX;
+    c->loaded = 0;
+    c->ring = NULL;
+    c->streaming = false;
+    arena_init(&c->bodies);
+    c->reference_buffers = NULL;
+    c->error_message = NULL;
+    c->error_point = 0;
     return c;
 }
 
+void compiler_set_name(Compiler *c, const char *name) {
+    c->buffer.name = arena_strndup(&c->arena, name, strlen(name));
+}
+
 void compiler_free(Compiler *c) {
-    free(c->buffer.content);
-    free(c->buffer.name);
-    for (size_t i = 0; i < c->procedures.num; i++) {
-        procedure_free(c->procedures.array[i]);
-    }
-    free(c->procedures.array);
-    if (c->output_file) {
-        fclose(c->output_file);
+    if (c->buffer.capacity > 0) {
+        free((char *)c->buffer.content);
     }
-    token_history_free(&c->history);
+    line_index_free(&c->buffer.lines);
+    emitter_free(&c->output);
+    emitter_free(&c->code);
+    arena_free(&c->bodies);
+    arena_free(&c->arena);
     free(c);
 }
 
+// Character classes
+enum {
+    CHAR_SPACE       = 1 << 0,
+    CHAR_IDENT_START = 1 << 1,
+    CHAR_IDENT       = 1 << 2,
+};
+
+static const uint8_t char_class[256] = {
+    [' ']         = CHAR_SPACE,
+    ['\t' ... '\r'] = CHAR_SPACE,
+    ['a' ... 'z'] = CHAR_IDENT_START | CHAR_IDENT,
+    ['A' ... 'Z'] = CHAR_IDENT_START | CHAR_IDENT,
+    ['_']         = CHAR_IDENT_START | CHAR_IDENT,
+    ['0' ... '9'] = CHAR_IDENT,
+};
+
+#define CHAR_IS(ch, class) (char_class[(unsigned char)(ch)] & (class))
+
+// Vector helpers, each returns a bitmask with one bit per byte of the
+// block that belongs to the class. Unsigned x <= k is tested as
+// min(x, k) == x since SSE2 has no unsigned compare.
+#if defined(__AVX2__)
+#define LEX_BLOCK 32
+typedef __m256i LexBlock;
+
+static inline uint32_t block_in_range(LexBlock v, char lo, char n) {
+    LexBlock x = _mm256_sub_epi8(v, _mm256_set1_epi8(lo));
+    LexBlock k = _mm256_set1_epi8(n);
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, k), x));
+}
+
+static inline uint32_t block_space_mask(const char *p) {
+    LexBlock v = _mm256_loadu_si256((const LexBlock *)p);
+    LexBlock sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    return _mm256_movemask_epi8(sp) | block_in_range(v, '\t', '\r' - '\t');
+}
+
+static inline uint32_t block_ident_mask(const char *p) {
+    LexBlock v = _mm256_loadu_si256((const LexBlock *)p);
+    LexBlock us = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+    LexBlock lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return _mm256_movemask_epi8(us) | block_in_range(lower, 'a', 'z' - 'a') |
+           block_in_range(v, '0', '9' - '0');
+}
+#elif defined(__SSE2__)
+#define LEX_BLOCK 16
+typedef __m128i LexBlock;
+
+static inline uint32_t block_in_range(LexBlock v, char lo, char n) {
+    LexBlock x = _mm_sub_epi8(v, _mm_set1_epi8(lo));
+    LexBlock k = _mm_set1_epi8(n);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, k), x));
+}
+
+static inline uint32_t block_space_mask(const char *p) {
+    LexBlock v = _mm_loadu_si128((const LexBlock *)p);
+    LexBlock sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    return _mm_movemask_epi8(sp) | block_in_range(v, '\t', '\r' - '\t');
+}
+
+static inline uint32_t block_ident_mask(const char *p) {
+    LexBlock v = _mm_loadu_si128((const LexBlock *)p);
+    LexBlock us = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    LexBlock lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_movemask_epi8(us) | block_in_range(lower, 'a', 'z' - 'a') |
+           block_in_range(v, '0', '9' - '0');
+}
+#endif
+
+#ifdef LEX_BLOCK
+#define LEX_FULL_MASK ((uint32_t)((1ull << LEX_BLOCK) - 1))
+#endif
+
+// Return the first offset at or after I that isn't whitespace.
+static size_t skip_space(const char *text, size_t i, size_t size) {
+#ifdef LEX_BLOCK
+    while (i + LEX_BLOCK <= size) {
+        uint32_t mask = ~block_space_mask(text + i) & LEX_FULL_MASK;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += LEX_BLOCK;
+    }
+#endif
+    while (i < size && CHAR_IS(text[i], CHAR_SPACE)) {
+        i++;
+    }
+    return i;
+}
+
+// Return the first offset at or after I that can't continue an identifier.
+static size_t scan_identifier(const char *text, size_t i, size_t size) {
+#ifdef LEX_BLOCK
+    while (i + LEX_BLOCK <= size) {
+        uint32_t mask = ~block_ident_mask(text + i) & LEX_FULL_MASK;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+        i += LEX_BLOCK;
+    }
+#endif
+    while (i < size && CHAR_IS(text[i], CHAR_IDENT)) {
+        i++;
+    }
+    return i;
+}
+
 // Lexer
-void lex(Compiler *c) {
+// Scan the token at CURSOR into *TYPE and *START. Returns NULL, or an
+// error message with the cursor left where it went wrong.
+static const char *scan_token(Buffer *buffer, Cursor *cursor, TokenType *type,
+                              size_t *start) {
     // Skip whitespace
-    while (isspace(cursor_peek(&c->cursor, &c->buffer))) {
-        cursor_advance(&c->cursor, &c->buffer);
-    }
+    cursor_jump(cursor, buffer, skip_space(buffer->content, cursor->point, buffer->size));
+    *start = cursor->point;
 
     // Check for end of file
-    if (cursor_is_at_end(&c->cursor, &c->buffer)) {
-        size_t end_pos = c->cursor.point;
-        c->current_token = token_new(TOKEN_EOF, "", c->cursor.row, c->cursor.col,
-                                     c->cursor.line, end_pos, end_pos);
-        token_history_add(&c->history, c->current_token);
-        return;
+    if (cursor_is_at_end(cursor, buffer)) {
+        *type = TOKEN_EOF;
+        return NULL;
     }
 
-    size_t start_row = c->cursor.row;
-    size_t start_col = c->cursor.col;
-    size_t start_line = c->cursor.line;
-    size_t start_pos = c->cursor.point;
-    char ch = cursor_peek(&c->cursor, &c->buffer);
+    char ch = cursor_peek(cursor, buffer);
 
-    if (isalpha(ch) || ch == '_') {
+    if (CHAR_IS(ch, CHAR_IDENT_START)) {
         // Identifier or keyword
-        char lexeme[256];
-        size_t lexeme_len = 0;
-        while (isalnum(cursor_peek(&c->cursor, &c->buffer)) ||
-               cursor_peek(&c->cursor, &c->buffer) == '_') {
-            lexeme[lexeme_len++] = cursor_peek(&c->cursor, &c->buffer);
-            cursor_advance(&c->cursor, &c->buffer);
-        }
-        lexeme[lexeme_len] = '\0';
-        size_t end_pos = c->cursor.point;
-
-        if (strcmp(lexeme, "proc") == 0) {
-            c->current_token = token_new(TOKEN_PROC, lexeme, start_row, start_col,
-                                         start_line, start_pos, end_pos);
-        } else {
-            c->current_token = token_new(TOKEN_IDENTIFIER, lexeme, start_row,
-                                         start_col, start_line, start_pos, end_pos);
-        }
+        size_t end_pos = scan_identifier(buffer->content, *start + 1, buffer->size);
+        cursor_jump(cursor, buffer, end_pos);
+        bool proc = end_pos - *start == 4 &&
+                    memcmp(buffer->content + *start, "proc", 4) == 0;
+        *type = proc ? TOKEN_PROC : TOKEN_IDENTIFIER;
     } else if (ch == ':') {
-        cursor_advance(&c->cursor, &c->buffer);
-        if (cursor_peek(&c->cursor, &c->buffer) == ':') {
-            cursor_advance(&c->cursor, &c->buffer);
-            size_t end_pos = c->cursor.point;
-            c->current_token = token_new(TOKEN_DOUBLE_COLON, "::", start_row,
-                                         start_col, start_line, start_pos, end_pos);
-        } else {
-            error(c, "Expected ':' after ':'");
+        cursor_advance(cursor, buffer);
+        if (cursor_peek(cursor, buffer) != ':') {
+            return "Expected ':' after ':'";
         }
+        cursor_advance(cursor, buffer);
+        *type = TOKEN_DOUBLE_COLON;
     } else if (ch == '(') {
-        cursor_advance(&c->cursor, &c->buffer);
-        size_t end_pos = c->cursor.point;
-        c->current_token = token_new(TOKEN_LPAREN, "(", start_row, start_col,
-                                     start_line, start_pos, end_pos);
+        cursor_advance(cursor, buffer);
+        *type = TOKEN_LPAREN;
     } else if (ch == ')') {
-        cursor_advance(&c->cursor, &c->buffer);
-        size_t end_pos = c->cursor.point;
-        c->current_token = token_new(TOKEN_RPAREN, ")", start_row, start_col,
-                                     start_line, start_pos, end_pos);
+        cursor_advance(cursor, buffer);
+        *type = TOKEN_RPAREN;
     } else if (ch == '{') {
-        cursor_advance(&c->cursor, &c->buffer);
-        size_t end_pos = c->cursor.point;
-        c->current_token = token_new(TOKEN_LBRACE, "{", start_row, start_col,
-                                     start_line, start_pos, end_pos);
+        cursor_advance(cursor, buffer);
+        *type = TOKEN_LBRACE;
     } else if (ch == '}') {
-        cursor_advance(&c->cursor, &c->buffer);
-        size_t end_pos = c->cursor.point;
-        c->current_token = token_new(TOKEN_RBRACE, "}", start_row, start_col,
-                                     start_line, start_pos, end_pos);
+        cursor_advance(cursor, buffer);
+        *type = TOKEN_RBRACE;
     } else {
-        error(c, "Unexpected character");
+        return "Unexpected character";
     }
+    return NULL;
+}
 
-    token_history_add(&c->history, c->current_token);
+// Scan the token at the cursor into current_token.
+static void scan(Compiler *c) {
+    TokenType type;
+    size_t start;
+    const char *message = scan_token(&c->buffer, &c->cursor, &type, &start);
+    if (message) {
+        error(c, message);
+    }
+    c->current_token = token_new(type, start, c->cursor.point);
 }
 
-// Parser
-Procedure *find_procedure(Compiler *c, const char *name) {
-    for (size_t i = 0; i < c->procedures.num; i++) {
-        if (strcmp(c->procedures.array[i]->name, name) == 0) {
-            return c->procedures.array[i];
+// Advance to the next token and record it. While replaying, the token
+// comes from the history instead, and while pipelined from the lexer
+// thread. Both stick at the final EOF. Loaded tokens are already
+// recorded, they only have to be counted.
+void lex(Compiler *c) {
+    if (c->history.count < c->loaded) {
+        c->current_token = c->history.tokens[c->history.count++];
+        Span lexeme = c->current_token.lexeme;
+        cursor_jump(&c->cursor, &c->buffer, lexeme.start + lexeme.length);
+        return;
+    }
+    if (c->ring) {
+        // The lexer thread is done after EOF, stick there too
+        if (c->current_token.type != TOKEN_EOF) {
+            token_ring_pop(c);
+            token_history_add(&c->history, c->current_token);
         }
+        return;
+    }
+    if (c->replay != SIZE_MAX) {
+        c->current_token = c->history.tokens[c->replay];
+        if (c->replay + 1 < c->history.count) {
+            c->replay++;
+        }
+        Span lexeme = c->current_token.lexeme;
+        cursor_jump(&c->cursor, &c->buffer, lexeme.start + lexeme.length);
+        return;
+    }
+    scan(c);
+    if (!c->streaming) {
+        token_history_add(&c->history, c->current_token);
     }
-    return NULL;
 }
 
-void parse_procedure(Compiler* c) {
-    if (c->current_token.type != TOKEN_IDENTIFIER) {
-        error(c, "Expected procedure name");
-    }
+// Incremental lexer
+static size_t span_end(Span span) {
+    return span.start + span.length;
+}
 
-    char* proc_name = strdup(c->current_token.lexeme);
-    Procedure* proc = find_procedure(c, proc_name);
+// Re-scan what EDIT touched. Lexing restarts after the last token that
+// ends before the edit and stops at the first token past it that starts
+// where an old token did, since the lexer has no state every token from
+// there on is an old one moved over. The new tokens end up at
+// [*first, *last) of the history.
+static void relex(Compiler *c, Edit edit, size_t *first, size_t *last) {
+    TokenHistory *history = &c->history;
+    Token *tokens = history->tokens;
+
+    // Tokens before KEEP are untouched
+    size_t lo = 0, hi = history->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (span_end(tokens[mid].lexeme) < edit.start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t keep = lo;
+
+    // Old tokens from NEXT on start after the edit, resync candidates
+    lo = keep, hi = history->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (tokens[mid].lexeme.start < edit.old_end) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t next = lo;
+
+    Token *fresh = NULL;
+    size_t num_fresh = 0, capacity = 0;
+    c->cursor.point = keep > 0 ? span_end(tokens[keep - 1].lexeme) : 0;
+    for (;;) {
+        scan(c);
+        size_t start = c->current_token.lexeme.start;
+        if (start >= edit.new_end) {
+            size_t old_start = start - edit.new_end + edit.old_end;
+            while (next < history->count && tokens[next].lexeme.start < old_start) {
+                next++;
+            }
+            if (next < history->count && tokens[next].lexeme.start == old_start &&
+                tokens[next].type == c->current_token.type) {
+                break;
+            }
+        }
+        if (num_fresh >= capacity) {
+            capacity = capacity == 0 ? 16 : capacity * 2;
+            fresh = realloc(fresh, capacity * sizeof(Token));
+        }
+        fresh[num_fresh++] = c->current_token;
+        if (c->current_token.type == TOKEN_EOF) {
+            next = history->count; // Only when the old EOF was lost
+            break;
+        }
+    }
 
-    if (!proc) {
-        proc = procedure_new(proc_name);
-        if (c->procedures.num >= c->procedures.capacity) {
-            c->procedures.capacity =
-                c->procedures.capacity == 0 ? 2 : c->procedures.capacity * 2;
-            c->procedures.array = realloc(
-                                          c->procedures.array, c->procedures.capacity * sizeof(Procedure *));
+    // Splice: KEEP old tokens, the fresh ones, then the moved tail
+    size_t tail = history->count - next;
+    size_t count = keep + num_fresh + tail;
+    if (count > history->capacity) {
+        size_t old_capacity = history->capacity;
+        while (history->capacity < count) {
+            history->capacity = history->capacity == 0 ? 8 : history->capacity * 2;
         }
-        c->procedures.array[c->procedures.num++] = proc;
+        history->tokens = arena_grow(history->arena, history->tokens,
+                                     old_capacity * sizeof(Token),
+                                     history->capacity * sizeof(Token));
+        allocations_add(&history->allocs, history->capacity * sizeof(Token));
+        tokens = history->tokens;
+    }
+    memmove(tokens + keep + num_fresh, tokens + next, tail * sizeof(Token));
+    for (size_t i = keep + num_fresh; i < count; i++) {
+        tokens[i].lexeme.start = tokens[i].lexeme.start - edit.old_end + edit.new_end;
     }
+    if (num_fresh > 0) {
+        memcpy(tokens + keep, fresh, num_fresh * sizeof(Token));
+    }
+    history->count = count;
+    free(fresh);
 
-    free(proc_name);
+    *first = keep;
+    *last = keep + num_fresh;
+}
 
-    lex(c); // Consume procedure name
+// Pipelined lexer
+static inline void ring_pause(unsigned *spins) {
+    if (++*spins < 64) {
+#if defined(__SSE2__)
+        _mm_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
 
-    if (c->current_token.type != TOKEN_DOUBLE_COLON) {
-        error(c, "Expected '::'");
+static void *lex_worker(void *arg) {
+    TokenRing *ring = arg;
+    Cursor cursor = {.point = ring->point};
+    size_t head = 0;
+    for (;;) {
+        TokenType type;
+        size_t start;
+        const char *message = scan_token(ring->buffer, &cursor, &type, &start);
+
+        unsigned spins = 0;
+        while (head - ring->tail_seen == TOKEN_RING_SIZE) {
+            ring->tail_seen = atomic_load_explicit(&ring->tail, memory_order_acquire);
+            if (head - ring->tail_seen < TOKEN_RING_SIZE) {
+                break;
+            }
+            if (atomic_load_explicit(&ring->stop, memory_order_relaxed)) {
+                return NULL;
+            }
+            ring_pause(&spins);
+        }
+
+        RingToken *slot = &ring->tokens[head & (TOKEN_RING_SIZE - 1)];
+        if (message) {
+            ring->error_message = message;
+            *slot = (RingToken){.start = cursor.point, .type = TOKEN_RING_ERROR};
+        } else {
+            *slot = (RingToken){.start = start, .length = cursor.point - start, .type = type};
+        }
+        atomic_store_explicit(&ring->head, ++head, memory_order_release);
+        if (message || type == TOKEN_EOF) {
+            return NULL;
+        }
     }
-    lex(c); // Consume '::'
+}
 
-    if (c->current_token.type != TOKEN_PROC) {
-        error(c, "Expected 'proc'");
+// Take the next token off the ring into current_token, waiting only
+// when the lexer thread has not got that far yet.
+void token_ring_pop(Compiler *c) {
+    TokenRing *ring = c->ring;
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned spins = 0;
+    while (tail == ring->head_seen) {
+        ring->head_seen = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail != ring->head_seen) {
+            break;
+        }
+        ring_pause(&spins);
     }
-    lex(c); // Consume 'proc'
 
-    if (c->current_token.type != TOKEN_LPAREN) {
-        error(c, "Expected '('");
+    RingToken token = ring->tokens[tail & (TOKEN_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    if (token.type == TOKEN_RING_ERROR) {
+        cursor_jump(&c->cursor, &c->buffer, token.start);
+        error(c, ring->error_message);
     }
-    lex(c); // Consume '('
+    c->current_token = token_new(token.type, token.start, token.start + token.length);
+    cursor_jump(&c->cursor, &c->buffer, token.start + token.length);
+}
 
-    if (c->current_token.type != TOKEN_RPAREN) {
-        error(c, "Expected ')'");
+// Parser
+Procedure *find_procedure(Compiler *c, Span name) {
+    return find_procedure_named(c, span_text(&c->buffer, name), name.length);
+}
+
+Procedure *find_procedure_named(Compiler *c, const char *name, size_t length) {
+    if (c->symbols.count == 0) {
+        return NULL;
     }
-    lex(c); // Consume ')'
+    return *symbol_table_slot(&c->symbols, name, length,
+                              hash_bytes(name, length));
+}
 
-    if (c->current_token.type != TOKEN_LBRACE) {
-        error(c, "Expected '{'");
+// Find the procedure called NAME, registering it if this is the first
+// time the name is seen.
+Procedure *intern_procedure(Compiler *c, Span name) {
+    Procedure *proc = intern_procedure_named(c, span_text(&c->buffer, name), name.length);
+    if (proc->reference.length == 0) {
+        proc->reference = name;
     }
-    lex(c); // Consume '{'
+    return proc;
+}
 
-    // Clear existing calls for this procedure
-    proc->num_calls = 0;
+Procedure *intern_procedure_named(Compiler *c, const char *name, size_t length) {
+    // Keep the load factor at or below 1/2
+    if ((c->symbols.count + 1) * 2 > c->symbols.capacity) {
+        symbol_table_grow(&c->symbols, &c->arena);
+    }
+
+    uint32_t hash = hash_bytes(name, length);
+    Procedure **slot = symbol_table_slot(&c->symbols, name, length, hash);
+    if (*slot) {
+        return *slot;
+    }
+
+    Procedure *proc = procedure_new(&c->arena, name, length);
+    proc->id = c->procedures.num;
+    if (c->procedures.num >= c->procedures.capacity) {
+        size_t old_capacity = c->procedures.capacity;
+        c->procedures.capacity =
+            c->procedures.capacity == 0 ? 2 : c->procedures.capacity * 2;
+        c->procedures.array = arena_grow(
+            &c->arena, c->procedures.array, old_capacity * sizeof(Procedure *),
+            c->procedures.capacity * sizeof(Procedure *));
+        allocations_add(&c->procedures.allocs,
+                        c->procedures.capacity * sizeof(Procedure *));
+    }
+    c->procedures.array[c->procedures.num++] = proc;
+    *slot = proc;
+    c->symbols.count++;
+    return proc;
+}
+
+// Parse one definition, returning the procedure it defines.
+Procedure *parse_procedure(Compiler* c) {
+    if (c->current_token.type != TOKEN_IDENTIFIER) {
+        error(c, "Expected procedure name");
+    }
+
+    Procedure* proc = intern_procedure(c, c->current_token.lexeme);
+    Span name = c->current_token.lexeme;
+    if (proc->defined) {
+        error(c, "Procedure is already defined");
+    }
+
+    lex(c); // Consume procedure name
+
+    if (c->current_token.type != TOKEN_DOUBLE_COLON) {
+        error(c, "Expected '::'");
+    }
+    lex(c); // Consume '::'
+
+    if (c->current_token.type != TOKEN_PROC) {
+        error(c, "Expected 'proc'");
+    }
+    lex(c); // Consume 'proc'
+
+    if (c->current_token.type != TOKEN_LPAREN) {
+        error(c, "Expected '('");
+    }
+    lex(c); // Consume '('
+
+    if (c->current_token.type != TOKEN_RPAREN) {
+        error(c, "Expected ')'");
+    }
+    lex(c); // Consume ')'
+
+    if (c->current_token.type != TOKEN_LBRACE) {
+        error(c, "Expected '{'");
+    }
+    lex(c); // Consume '{'
+
+    proc->defined = true;
+    proc->definition = name;
 
     while (c->current_token.type != TOKEN_RBRACE) {
         if (c->current_token.type != TOKEN_IDENTIFIER) {
@@ -401,20 +1395,9 @@ void parse_procedure(Compiler* c) {
         }
 
         // Find or create the called procedure
-        Procedure* called_proc = find_procedure(c, c->current_token.lexeme);
-        if (!called_proc) {
-            called_proc = procedure_new(c->current_token.lexeme);
-            if (c->procedures.num >= c->procedures.capacity) {
-                c->procedures.capacity =
-                    c->procedures.capacity == 0 ? 2 : c->procedures.capacity * 2;
-                c->procedures.array =
-                    realloc(c->procedures.array,
-                            c->procedures.capacity * sizeof(Procedure *));
-            }
-            c->procedures.array[c->procedures.num++] = called_proc;
-        }
+        Procedure* called_proc = intern_procedure(c, c->current_token.lexeme);
 
-        procedure_add_call(proc, called_proc);
+        procedure_add_call(c->streaming ? &c->bodies : &c->arena, proc, called_proc);
 
         lex(c); // Consume procedure name
 
@@ -430,9 +1413,10 @@ void parse_procedure(Compiler* c) {
     }
 
     lex(c); // Consume '}'
+    return proc;
 }
 
-void parse(Compiler* c) {
+static void parse_tokens(Compiler* c) {
     lex(c); // Get the first token
 
     while (c->current_token.type != TOKEN_EOF) {
@@ -440,410 +1424,3912 @@ void parse(Compiler* c) {
     }
 }
 
-// Code generator
-void generate_code(Compiler* c) {
-    c->output_file = fopen("output.asm", "w");
-    if (!c->output_file) {
-        error(c, "Could not create output file");
+// Parse with the lexer running ahead on another thread. Errors come
+// back here first so the thread can be stopped before they are raised.
+static void parse_pipelined(Compiler* c) {
+    TokenRing *ring = aligned_alloc(_Alignof(TokenRing), sizeof(TokenRing));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->stop, false);
+    ring->tail_seen = 0;
+    ring->head_seen = 0;
+    ring->buffer = &c->buffer;
+    ring->point = c->cursor.point;
+
+    pthread_t lexer;
+    if (pthread_create(&lexer, NULL, lex_worker, ring) != 0) {
+        free(ring);
+        parse_tokens(c);
+        return;
     }
 
-    // Write assembly header
-    fprintf(c->output_file, "global _start\n\n");
-    fprintf(c->output_file, "section .text\n\n");
-
-    // Generate code for each procedure
-    for (size_t i = 0; i < c->procedures.num; i++) {
-        Procedure* proc = c->procedures.array[i];
-        fprintf(c->output_file, "%s:\n", proc->name);
-        fprintf(c->output_file, "    push rbp\n");
-        fprintf(c->output_file, "    mov rbp, rsp\n");
+    jmp_buf recover;
+    jmp_buf *outer = c->recover;
+    c->recover = &recover;
+    c->ring = ring;
+    bool failed = setjmp(recover) != 0;
+    if (!failed) {
+        parse_tokens(c);
+    }
+    c->ring = NULL;
+    c->recover = outer;
 
-        // Generate calls
-        for (size_t j = 0; j < proc->num_calls; j++) {
-            fprintf(c->output_file, "    call %s\n", proc->calls[j]->name);
-        }
+    atomic_store_explicit(&ring->stop, true, memory_order_relaxed);
+    pthread_join(lexer, NULL);
+    free(ring);
 
-        fprintf(c->output_file, "    mov rsp, rbp\n");
-        fprintf(c->output_file, "    pop rbp\n");
-        fprintf(c->output_file, "    ret\n\n");
+    if (failed) {
+        cursor_jump(&c->cursor, &c->buffer, c->error_point);
+        error(c, c->error_message);
     }
+}
 
-    // Write _start function
-    fprintf(c->output_file, "_start:\n");
-    fprintf(c->output_file, "    call main\n");
-    fprintf(c->output_file, "    mov rax, 60\n");
-    fprintf(c->output_file, "    xor rdi, rdi\n");
-    fprintf(c->output_file, "    syscall\n");
+// Files below this are lexed in line, a thread costs more than it saves
+#define PIPELINE_MIN_SIZE (64 * 1024)
 
-    fclose(c->output_file);
-    c->output_file = NULL;
+void parse(Compiler* c) {
+    if (pipeline_lexer && c->replay == SIZE_MAX &&
+        c->buffer.size >= PIPELINE_MIN_SIZE && c->buffer.size <= UINT32_MAX) {
+        parse_pipelined(c);
+    } else {
+        parse_tokens(c);
+    }
 }
 
-void error(Compiler* c, const char* message) {
-    fprintf(stderr, "Error at line %zu, column %zu: %s\n", c->cursor.row, c->cursor.col, message);
-    exit(1);
+// Incremental parser
+static bool starts_procedure(TokenHistory *history, size_t i) {
+    return history->tokens[i].type == TOKEN_IDENTIFIER &&
+           history->tokens[i + 1].type == TOKEN_DOUBLE_COLON;
 }
 
-#include <lume.h>
+// Re-parse the whole procedures that tokens [first, last) fall in,
+// once relex is done with EDIT. What those procedures defined is
+// dropped from the symbol table and parsed again from the history,
+// and the spans of everything after them move with the edit.
+static void reparse(Compiler* c, Edit edit, size_t first, size_t last) {
+    TokenHistory *history = &c->history;
+
+    // Both tokens of the 'name ::' that bounds the region have to be
+    // old ones, or the old text may have had no procedure there
+    size_t from = 0;
+    for (size_t i = first; i >= 2; i--) {
+        if (starts_procedure(history, i - 2)) {
+            from = i - 2;
+            break;
+        }
+    }
+    size_t to = history->count - 1; // EOF
+    for (size_t i = last; i + 1 < history->count; i++) {
+        if (starts_procedure(history, i)) {
+            to = i;
+            break;
+        }
+    }
 
-int sw = 1920;
-int sh = 1080;
+    size_t start = from > 0 ? history->tokens[from].lexeme.start : 0;
+    size_t new_end = history->tokens[to].lexeme.start;
+    size_t old_end = new_end - edit.new_end + edit.old_end;
 
-void drawCompilerState(Font *font, Compiler *c, int step_count) {
-    char state_info[256];
-    const char *lexeme = "(null)";
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        Procedure *proc = c->procedures.array[i];
+        if (proc->defined && proc->definition.start >= start &&
+            proc->definition.start < old_end) {
+            for (size_t j = 0; j < proc->num_calls; j++) {
+                proc->calls[j]->num_references--;
+            }
+            proc->num_calls = 0;
+            proc->defined = false;
+            proc->definition = (Span){0};
+        }
+        if (proc->definition.start >= old_end) {
+            proc->definition.start = proc->definition.start - old_end + new_end;
+        }
+        if (proc->reference.start >= old_end) {
+            proc->reference.start = proc->reference.start - old_end + new_end;
+        } else if (proc->reference.start >= start) {
+            proc->reference = (Span){0}; // Set again if still mentioned
+        }
+    }
 
-    if (c->current_token.lexeme) {
-        lexeme = c->current_token.lexeme;
+    c->replay = from;
+    lex(c);
+    while (c->current_token.lexeme.start < new_end) {
+        parse_procedure(c);
     }
+    c->replay = SIZE_MAX;
+}
 
-    snprintf(state_info, sizeof(state_info),
-             "Step: %d, Token: %s, Line: %zu, Col: %zu", step_count, lexeme,
-             c->cursor.row, c->cursor.col);
+// Bring the tokens and procedures up to date with EDIT, which has been
+// applied to the buffer already. Returns false if that hit an error, the
+// compiler is then out of step with its text and should be rebuilt.
+bool compiler_update(Compiler* c, Edit edit) {
+    buffer_close_gap(&c->buffer);
+    jmp_buf recover;
+    jmp_buf *outer = c->recover;
+    c->recover = &recover;
+    bool ok = false;
+    if (setjmp(recover) == 0) {
+        size_t first, last;
+        relex(c, edit, &first, &last);
+        reparse(c, edit, first, last);
+        ok = true;
+    }
+    c->recover = outer;
+    c->replay = SIZE_MAX;
+    return ok;
+}
 
-    drawText(font, state_info, 10, 40, CT.text);
+// Call graph
+static inline size_t call_graph_degree(CallGraph *graph, size_t id) {
+    return graph->offsets[id + 1] - graph->offsets[id];
 }
 
-void drawBuffer(Compiler *c, Font *font, float startX, float startY,
-                float scrollX, float scrollY) {
-    if (!c || !font || !c->buffer.content)
-        return;
+static inline uint32_t *call_graph_calls(CallGraph *graph, size_t id) {
+    return graph->edges + graph->offsets[id];
+}
 
-    const char *text = c->buffer.content;
-    float x = startX - scrollX;
-    float y = startY + scrollY;
-    size_t charIndex = 0;
-    size_t tokenIndex = 0;
+// Flatten the parsed Procedure.calls lists into GRAPH.
+void call_graph_build(Arena *arena, CallGraph *graph, Procedures *procedures) {
+    size_t n = procedures->num;
+    graph->num_nodes = n;
+    graph->offsets = arena_alloc(arena, (n + 1) * sizeof(uint32_t));
 
-    useShader("text");
+    size_t num_edges = 0;
+    for (size_t i = 0; i < n; i++) {
+        graph->offsets[i] = num_edges;
+        num_edges += procedures->array[i]->num_calls;
+    }
+    graph->offsets[n] = num_edges;
+    graph->num_edges = num_edges;
 
-    while (charIndex < c->buffer.size) {
-        if (text[charIndex] == '\n') {
-            x = startX - scrollX;
-            y -= (font->ascent + font->descent);
-            charIndex++;
-            continue;
+    graph->edges = arena_alloc(arena, num_edges * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        Procedure *proc = procedures->array[i];
+        uint32_t *calls = call_graph_calls(graph, i);
+        for (size_t j = 0; j < proc->num_calls; j++) {
+            calls[j] = proc->calls[j]->id;
         }
+    }
+}
 
-        Color currentColor = CT.text; // Default color
+// Callers of every procedure, one edge per call site, by counting sort.
+// Each node lists its callers in increasing id order.
+void call_graph_reverse(Arena *arena, CallGraph *graph, CallGraph *reverse) {
+    size_t n = graph->num_nodes;
+    reverse->num_nodes = n;
+    reverse->num_edges = graph->num_edges;
+    reverse->offsets = arena_alloc(arena, (n + 1) * sizeof(uint32_t));
+    reverse->edges = arena_alloc(arena, graph->num_edges * sizeof(uint32_t));
+
+    memset(reverse->offsets, 0, (n + 1) * sizeof(uint32_t));
+    for (size_t e = 0; e < graph->num_edges; e++) {
+        reverse->offsets[graph->edges[e] + 1]++;
+    }
+    for (size_t i = 0; i < n; i++) {
+        reverse->offsets[i + 1] += reverse->offsets[i];
+    }
 
-        if (charIndex == c->cursor.point) {
-            currentColor = CT.bg; // Highlight color for cursor position
-        } else {
-            if (single_highlight_mode) {
-                // Only highlight the current token
-                if (charIndex >= c->current_token.face.start &&
-                    charIndex < c->current_token.face.end) {
-                    currentColor = c->current_token.face.fg;
-                }
-            } else {
-                // Highlight all tokens
-                while (tokenIndex < c->history.count &&
-                       charIndex >= c->history.tokens[tokenIndex].face.end) {
-                    tokenIndex++;
-                }
+    uint32_t *fill = malloc((n + 1) * sizeof(uint32_t));
+    memcpy(fill, reverse->offsets, (n + 1) * sizeof(uint32_t));
+    for (size_t caller = 0; caller < n; caller++) {
+        for (uint32_t e = graph->offsets[caller]; e < graph->offsets[caller + 1]; e++) {
+            reverse->edges[fill[graph->edges[e]]++] = caller;
+        }
+    }
+    free(fill);
+}
 
-                if (tokenIndex < c->history.count &&
-                    charIndex >= c->history.tokens[tokenIndex].face.start &&
-                    charIndex < c->history.tokens[tokenIndex].face.end) {
-                    currentColor = c->history.tokens[tokenIndex].face.fg;
-                }
-            }
+// Optimizer
+// Flag everything main can reach, walking Compiler.graph depth first.
+// Only reachable procedures are emitted, and a reachable one without a
+// body is an error rather than an empty procedure.
+bool mark_reachable(Compiler* c) {
+    Procedure *main_proc = find_procedure_named(c, "main", 4);
+    if (!main_proc || !main_proc->defined) {
+        if (c->reference_buffers) {
+            fprintf(stderr, "Error: No 'main' procedure defined\n"); // In no file
+        } else {
+            fprintf(stderr, "%s: Error: No 'main' procedure defined\n", c->buffer.name);
         }
+        return false;
+    }
 
-        drawChar(font, text[charIndex], x, y, 1.0, 1.0, currentColor);
+    Procedure **procs = c->procedures.array;
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        procs[i]->reachable = false;
+    }
 
-        x += getCharacterWidth(font, text[charIndex]);
-        charIndex++;
+    // Each procedure is pushed at most once, when it is first marked
+    uint32_t *stack = malloc(c->procedures.num * sizeof(uint32_t));
+    size_t top = 0;
+    main_proc->reachable = true;
+    stack[top++] = main_proc->id;
+
+    bool ok = true;
+    while (top > 0) {
+        uint32_t id = stack[--top];
+        if (!procs[id]->defined) {
+            // Reported at the first call, in whichever file that is
+            Buffer *buffer = c->reference_buffers ? c->reference_buffers[id] : &c->buffer;
+            Position pos = buffer_position(buffer, procs[id]->reference.start);
+            fprintf(stderr, "%s: Error at line %zu, column %zu: "
+                    "Procedure '%s' is called but never defined\n",
+                    buffer->name, pos.row, pos.col, procs[id]->name);
+            ok = false;
+        }
+        uint32_t *calls = call_graph_calls(&c->graph, id);
+        for (size_t j = 0; j < call_graph_degree(&c->graph, id); j++) {
+            if (!procs[calls[j]]->reachable) {
+                procs[calls[j]]->reachable = true;
+                stack[top++] = calls[j];
+            }
+        }
     }
 
-    flush();
+    free(stack);
+    return ok;
 }
 
-/* void drawBuffer(Compiler *c, Font *font, float startX, float startY, */
-/*                 float scrollX, float scrollY) { */
-/*     if (!c || !font || !c->buffer.content) */
-/*         return; */
-
-/*     const char *text = c->buffer.content; */
-/*     float x = startX - scrollX; */
-/*     float y = startY + scrollY; */
-/*     size_t charIndex = 0; */
-/*     size_t tokenIndex = 0; */
-
-/*     useShader("text"); */
-
-/*     while (charIndex < c->buffer.size) { */
-/*         if (text[charIndex] == '\n') { */
-/*             x = startX - scrollX; */
-/*             y -= (font->ascent + font->descent); */
-/*             charIndex++; */
-/*             continue; */
-/*         } */
+// Tarjan's strongly connected components, iteratively. Fills ORDER
+// with the ids reachable from ROOT, each component complete before
+// any of its callers (reverse topological order), and COMPONENT with
+// the index of each one's component. Sets Procedure.recursion and
+// returns how many were written.
+size_t find_sccs(Compiler* c, uint32_t root, uint32_t *order, uint32_t *component) {
+    CallGraph *graph = &c->graph;
+    size_t n = graph->num_nodes;
+    size_t *index = malloc(n * sizeof(size_t));
+    size_t *low = malloc(n * sizeof(size_t));
+    size_t *next_call = malloc(n * sizeof(size_t));
+    bool *on_stack = calloc(n, sizeof(bool));
+    uint32_t *path = malloc(n * sizeof(uint32_t));  // DFS path
+    uint32_t *stack = malloc(n * sizeof(uint32_t)); // Tarjan stack
+    size_t path_top = 0, stack_top = 0, counter = 0, num_order = 0;
+    uint32_t num_components = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        index[i] = SIZE_MAX;
+        component[i] = UINT32_MAX;
+    }
 
-/*         Color currentColor = CT.text; // Default color */
+    index[root] = low[root] = counter++;
+    next_call[root] = 0;
+    path[path_top++] = root;
+    stack[stack_top++] = root;
+    on_stack[root] = true;
+
+    while (path_top > 0) {
+        uint32_t v = path[path_top - 1];
+        if (next_call[v] < call_graph_degree(graph, v)) {
+            uint32_t w = call_graph_calls(graph, v)[next_call[v]++];
+            if (index[w] == SIZE_MAX) {
+                index[w] = low[w] = counter++;
+                next_call[w] = 0;
+                path[path_top++] = w;
+                stack[stack_top++] = w;
+                on_stack[w] = true;
+            } else if (on_stack[w] && index[w] < low[v]) {
+                low[v] = index[w];
+            }
+            continue;
+        }
 
-/*         if (single_highlight_mode) { */
-/*             // Only highlight the current token */
-/*             if (charIndex >= c->current_token.face.start && */
-/*                 charIndex < c->current_token.face.end) { */
-/*                 currentColor = c->current_token.face.fg; */
-/*             } */
-/*         } else { */
-/*             // Highlight all tokens */
-/*             while (tokenIndex < c->history.count && */
-/*                    charIndex >= c->history.tokens[tokenIndex].face.end) { */
-/*                 tokenIndex++; */
-/*             } */
+        path_top--;
+        if (path_top > 0) {
+            uint32_t u = path[path_top - 1];
+            if (low[v] < low[u]) {
+                low[u] = low[v];
+            }
+        }
 
-/*             if (tokenIndex < c->history.count && */
-/*                 charIndex >= c->history.tokens[tokenIndex].face.start && */
-/*                 charIndex < c->history.tokens[tokenIndex].face.end) { */
-/*                 currentColor = c->history.tokens[tokenIndex].face.fg; */
-/*             } */
-/*         } */
+        if (low[v] == index[v]) {
+            // V roots a component, everything above it on the stack
+            size_t first = num_order;
+            uint32_t w;
+            do {
+                w = stack[--stack_top];
+                on_stack[w] = false;
+                component[w] = num_components;
+                order[num_order++] = w;
+            } while (w != v);
+
+            // Calls that stay inside the component are what make it
+            // recurse, it only loops if all of them are last calls
+            bool cyclic = num_order - first > 1;
+            bool all_tail = true;
+            for (size_t k = first; k < num_order; k++) {
+                uint32_t *calls = call_graph_calls(graph, order[k]);
+                size_t num_calls = call_graph_degree(graph, order[k]);
+                for (size_t j = 0; j < num_calls; j++) {
+                    if (component[calls[j]] == num_components) {
+                        cyclic = true;
+                        all_tail = all_tail && j + 1 == num_calls;
+                    }
+                }
+            }
+            Recursion recursion = !cyclic ? RECURSION_NONE :
+                                  all_tail ? RECURSION_TAIL : RECURSION_FULL;
+            for (size_t k = first; k < num_order; k++) {
+                c->procedures.array[order[k]]->recursion = recursion;
+            }
+            num_components++;
+        }
+    }
 
-/*         drawChar(font, text[charIndex], x, y, 1.0, 1.0, currentColor); */
+    free(index);
+    free(low);
+    free(next_call);
+    free(on_stack);
+    free(path);
+    free(stack);
+    return num_order;
+}
 
-/*         x += getCharacterWidth(font, text[charIndex]); */
-/*         charIndex++; */
-/*     } */
+static bool is_inlinable(Procedure *callee, uint32_t length) {
+    return callee->defined && callee->recursion == RECURSION_NONE &&
+           length <= inline_threshold;
+}
 
-/*     flush(); */
-/* } */
+// Replace calls to small non-recursive procedures with their bodies.
+// Callees are visited before their callers so their bodies are already
+// flattened, and calls to empty procedures simply disappear. Inlining
+// stops growing the program once it has added inline_budget percent
+// more call sites. The result replaces Compiler.graph.
+void inline_procedures(Compiler* c) {
+    CallGraph *graph = &c->graph;
+    size_t n = graph->num_nodes;
+    Procedure *main_proc = find_procedure_named(c, "main", 4);
+    uint32_t *order = malloc(n * sizeof(uint32_t));
+    uint32_t *component = malloc(n * sizeof(uint32_t));
+    size_t num_order = find_sccs(c, main_proc->id, order, component);
+
+    size_t total_calls = 0;
+    for (size_t i = 0; i < num_order; i++) {
+        total_calls += call_graph_degree(graph, order[i]);
+    }
+    size_t budget = total_calls * inline_budget / 100;
+    size_t growth = 0;
+
+    // Bodies start out as the old edges and flattened ones are appended
+    // after them, so the pool never has to grow past this
+    uint32_t *pool = malloc((2 * graph->num_edges + budget) * sizeof(uint32_t));
+    uint32_t *start = malloc(n * sizeof(uint32_t));
+    uint32_t *length = malloc(n * sizeof(uint32_t));
+    memcpy(pool, graph->edges, graph->num_edges * sizeof(uint32_t));
+    size_t pool_size = graph->num_edges;
+    for (size_t i = 0; i < n; i++) {
+        start[i] = graph->offsets[i];
+        length[i] = call_graph_degree(graph, i);
+    }
 
-/* void drawBuffer(Compiler *c, Font *font, float startX, float startY, */
-/*                 float scrollX, float scrollY) { */
-/*     if (!c || !font || !c->buffer.content) */
-/*         return; */
+    for (size_t i = 0; i < num_order; i++) {
+        uint32_t id = order[i];
+        size_t first = pool_size;
+        for (uint32_t j = 0; j < length[id]; j++) {
+            uint32_t callee = pool[start[id] + j];
+            size_t extra = length[callee] > 0 ? length[callee] - 1 : 0;
+            if (is_inlinable(c->procedures.array[callee], length[callee]) &&
+                growth + extra <= budget) {
+                memcpy(pool + pool_size, pool + start[callee],
+                       length[callee] * sizeof(uint32_t));
+                pool_size += length[callee];
+                growth += extra;
+            } else {
+                pool[pool_size++] = callee;
+            }
+        }
+        start[id] = first;
+        length[id] = pool_size - first;
+    }
 
-/*     const char *text = c->buffer.content; */
-/*     float x = startX - scrollX; */
-/*     float y = startY + scrollY; */
-/*     size_t charIndex = 0; */
-/*     size_t tokenIndex = 0; */
+    // Pack the bodies back into id order
+    CallGraph flat;
+    flat.num_nodes = n;
+    flat.offsets = arena_alloc(&c->arena, (n + 1) * sizeof(uint32_t));
+    size_t num_edges = 0;
+    for (size_t i = 0; i < n; i++) {
+        flat.offsets[i] = num_edges;
+        num_edges += length[i];
+    }
+    flat.offsets[n] = num_edges;
+    flat.num_edges = num_edges;
+    flat.edges = arena_alloc(&c->arena, num_edges * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        memcpy(flat.edges + flat.offsets[i], pool + start[i], length[i] * sizeof(uint32_t));
+    }
+    c->graph = flat;
 
-/*     useShader("text"); */
+    free(order);
+    free(component);
+    free(pool);
+    free(start);
+    free(length);
+}
 
-/*     while (charIndex < c->buffer.size) { */
-/*         if (text[charIndex] == '\n') { */
-/*             x = startX - scrollX; */
-/*             y -= (font->ascent + font->descent); */
-/*             charIndex++; */
-/*             continue; */
-/*         } */
+// Run the analysis and optimization passes between parse and codegen.
+bool optimize(Compiler* c) {
+    call_graph_build(&c->arena, &c->graph, &c->procedures);
+    if (!mark_reachable(c)) {
+        return false;
+    }
+    if (optimization_level >= 2) {
+        inline_procedures(c);
+        mark_reachable(c); // Drop what is only called from inlined sites
+    }
+    analyze_stack(c);
+    return true;
+}
 
-/*         Color currentColor = CT.text; // Default color */
+// Emitter
+void emitter_init(Emitter *e) {
+    e->data = NULL;
+    e->size = 0;
+    e->capacity = 0;
+}
 
-/*         // Find the current token */
-/*         while (tokenIndex < c->history.count && */
-/*                charIndex >= c->history.tokens[tokenIndex].face.end) { */
-/*             tokenIndex++; */
-/*         } */
+static void emitter_reserve(Emitter *e, size_t length) {
+    if (e->size + length <= e->capacity) {
+        return;
+    }
+    size_t capacity = e->capacity == 0 ? 4096 : e->capacity;
+    while (capacity < e->size + length) {
+        capacity *= 2;
+    }
+    e->data = realloc(e->data, capacity);
+    if (!e->data) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        exit(1);
+    }
+    e->capacity = capacity;
+}
 
-/*         if (tokenIndex < c->history.count && */
-/*             charIndex >= c->history.tokens[tokenIndex].face.start && */
-/*             charIndex < c->history.tokens[tokenIndex].face.end) { */
-/*             currentColor = c->history.tokens[tokenIndex].face.fg; */
-/*         } */
+void emit_bytes(Emitter *e, const char *bytes, size_t length) {
+    emitter_reserve(e, length);
+    memcpy(e->data + e->size, bytes, length);
+    e->size += length;
+}
 
-/*         drawChar(font, text[charIndex], x, y, 1.0, 1.0, currentColor); */
+void emit_char(Emitter *e, char ch) {
+    emitter_reserve(e, 1);
+    e->data[e->size++] = ch;
+}
 
-/*         x += getCharacterWidth(font, text[charIndex]); */
-/*         charIndex++; */
-/*     } */
+// Emit a string literal without measuring it at runtime
+#define emit_literal(e, str) emit_bytes((e), (str), sizeof(str) - 1)
 
-/*     flush(); */
-/* } */
+// Write everything emitted so far to PATH, '-' meaning stdout.
+bool emitter_write(Emitter *e, const char *path) {
+    bool to_stdout = strcmp(path, "-") == 0;
+    int fd = to_stdout ? STDOUT_FILENO : open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create output file '%s'\n", path);
+        return false;
+    }
 
-void drawCursor(Compiler *c, Font *font, float startX, float startY,
-                float scrollX, float scrollY, Color cursorColor) {
-    float cursorX = startX - scrollX;
-    float cursorY = startY + scrollY;
-    int lineCount = 0;
-
-    for (size_t i = 0; i < c->cursor.point; i++) {
-        if (c->buffer.content[i] == '\n') {
-            lineCount++;
-            cursorX = startX - scrollX;
-        } else {
-            cursorX += getCharacterWidth(font, c->buffer.content[i]);
+    size_t written = 0;
+    while (written < e->size) {
+        ssize_t n = write(fd, e->data + written, e->size - written);
+        if (n < 0) {
+            fprintf(stderr, "Error: Failed to write '%s'\n", path);
+            if (!to_stdout) {
+                close(fd);
+            }
+            return false;
         }
+        written += n;
     }
 
-    float cursorWidth =
-        (c->cursor.point < c->buffer.size &&
-         c->buffer.content[c->cursor.point] != '\n')
-        ? getCharacterWidth(font, c->buffer.content[c->cursor.point])
-        : getCharacterWidth(font, ' ');
+    if (!to_stdout) {
+        close(fd);
+    }
+    return true;
+}
 
-    cursorY -= lineCount * (font->ascent + font->descent) + (font->descent * 2);
+void emitter_free(Emitter *e) {
+    free(e->data);
+    emitter_init(e);
+}
 
-    Vec2f cursorPosition = {cursorX, cursorY};
-    Vec2f cursorSize = {cursorWidth, font->ascent + font->descent};
+// Build cache
+// --cache FILE keeps the output of the last build that succeeded. When
+// the sources and every flag that shapes the output are unchanged it
+// is written out again, skipping lexing, parsing, the optimizer and
+// code generation. The file is a header of magic, version, key, output
+// size and a hash of the output, then the output itself.
+#define CACHE_MAGIC "IMPC"
+#define CACHE_VERSION 2
+#define CACHE_HEADER_SIZE 32
+#define FNV_OFFSET 14695981039346656037ULL
+
+void cache_init(Cache *cache) {
+    cache->path = NULL;
+    cache->file = NULL;
+    cache->file_size = 0;
+    cache->mapped = false;
+    cache->key = 0;
+    cache->output = NULL;
+    cache->output_size = 0;
+    cache->hits = 0;
+    cache->misses = 0;
+}
 
-    useShader("simple");
-    drawRectangle(cursorPosition, cursorSize, cursorColor);
-    flush();
+// FNV-1a, 64 bits wide so keys from big programs don't collide
+uint64_t hash64_bytes(uint64_t hash, const void *bytes, size_t length) {
+    const unsigned char *p = bytes;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
 }
 
-int  fontsize    = 82;
+// The same a word at a time, for whole sources. Every step is a
+// bijection of the hash, so inputs differing in one word never collide.
+uint64_t hash64_words(uint64_t hash, const void *bytes, size_t length) {
+    const char *p = bytes;
+    size_t words = length / 8;
+    for (size_t i = 0; i < words; i++) {
+        uint64_t word;
+        memcpy(&word, p + i * 8, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ULL;
+        hash ^= hash >> 32;
+    }
+    return hash64_bytes(hash, p + words * 8, length % 8);
+}
+
+static uint32_t read_u32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint64_t read_u64(const char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Turn caching on for a build with KEY, finding the output of the last
+// one if it had the same key. A missing, stale or damaged file is a
+// miss, the build runs and replaces it.
+bool cache_load(Cache *cache, const char *path, uint64_t key) {
+    cache->path = path;
+    cache->key = key;
+    if (access(path, R_OK) == 0 &&
+        read_file(path, &cache->file, &cache->file_size, &cache->mapped)) {
+        const char *p = cache->file;
+        size_t size = cache->file_size;
+        if (size >= CACHE_HEADER_SIZE && memcmp(p, CACHE_MAGIC, 4) == 0 &&
+            read_u32(p + 4) == CACHE_VERSION && read_u64(p + 8) == key &&
+            read_u64(p + 16) == size - CACHE_HEADER_SIZE &&
+            read_u64(p + 24) == hash64_words(FNV_OFFSET, p + CACHE_HEADER_SIZE,
+                                             size - CACHE_HEADER_SIZE)) {
+            cache->output = p + CACHE_HEADER_SIZE;
+            cache->output_size = size - CACHE_HEADER_SIZE;
+            cache->hits++;
+            return true;
+        }
+    } else {
+        cache->file = NULL;
+    }
+    cache->misses++;
+    return false;
+}
+
+// Replace the cache file with OUTPUT. It's written next to it and
+// renamed over, so a build that dies halfway leaves the old cache.
+bool cache_save(Cache *cache, const char *output, size_t size) {
+    char header[CACHE_HEADER_SIZE] = CACHE_MAGIC;
+    uint32_t version = CACHE_VERSION;
+    uint64_t check = hash64_words(FNV_OFFSET, output, size);
+    uint64_t size64 = size;
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &cache->key, 8);
+    memcpy(header + 16, &size64, 8);
+    memcpy(header + 24, &check, 8);
+
+    Emitter file;
+    emitter_init(&file);
+    emit_bytes(&file, header, sizeof(header));
+    emit_bytes(&file, output, size);
+
+    size_t length = strlen(cache->path);
+    char *temp = malloc(length + 5);
+    memcpy(temp, cache->path, length);
+    memcpy(temp + length, ".tmp", 5);
+    bool ok = emitter_write(&file, temp) && rename(temp, cache->path) == 0;
+    if (!ok) {
+        fprintf(stderr, "Warning: Could not update cache '%s'\n", cache->path);
+        unlink(temp);
+    }
+    free(temp);
+    emitter_free(&file);
+    return ok;
+}
+
+void cache_free(Cache *cache) {
+    if (cache->file) {
+        release_file(cache->file, cache->file_size, cache->mapped);
+    }
+    cache_init(cache);
+}
+
+// Code generator
+// Whether call J of a procedure making NUM_CALLS calls can be a jump
+// that reuses the caller's return.
+static bool is_tail_call(size_t num_calls, size_t j) {
+    return optimization_level >= 1 && j + 1 == num_calls;
+}
+
+static bool ends_in_tail_call(size_t num_calls) {
+    return num_calls > 0 && is_tail_call(num_calls, num_calls - 1);
+}
+
+typedef enum {
+    FRAME_POINTER, // push rbp; mov rbp, rsp
+    FRAME_PAD,     // push rax, only to keep rsp 16-byte aligned at calls
+    FRAME_NONE     // Nothing, the procedure never calls with rsp misaligned
+} Frame;
+
+// No procedure has locals, so a frame pointer is only kept when asked
+// for. Entry leaves rsp 8 off a 16-byte boundary, so procedures that
+// still make real calls push a pad word, while leaves and those whose
+// only call is a tail jump need no prologue at all.
+static Frame frame_kind(size_t num_calls) {
+    if (optimization_level < 1 || keep_frame_pointer) {
+        return FRAME_POINTER;
+    }
+    size_t real_calls = num_calls - (ends_in_tail_call(num_calls) ? 1 : 0);
+    return real_calls > 0 ? FRAME_PAD : FRAME_NONE;
+}
+
+static size_t frame_size(Frame frame) {
+    return frame == FRAME_NONE ? 0 : 8;
+}
+
+// Worst case stack use of everything reachable from main, following
+// the frames and tail jumps the code generator will emit. Each call
+// costs its return address plus the caller's frame, a tail jump only
+// what the callee itself needs. A cycle whose calls back into itself
+// are not all jumps has no bound.
+void analyze_stack(Compiler* c) {
+    CallGraph *graph = &c->graph;
+    size_t n = graph->num_nodes;
+    Procedure **procs = c->procedures.array;
+    Procedure *main_proc = find_procedure_named(c, "main", 4);
+    uint32_t *order = malloc(n * sizeof(uint32_t));
+    uint32_t *component = malloc(n * sizeof(uint32_t));
+    size_t num_order = find_sccs(c, main_proc->id, order, component);
+
+    // Components are contiguous in ORDER and come after their callees
+    size_t first = 0;
+    while (first < num_order) {
+        size_t end = first;
+        while (end < num_order && component[order[end]] == component[order[first]]) {
+            end++;
+        }
+
+        Recursion recursion = procs[order[first]]->recursion;
+        bool bounded = recursion == RECURSION_NONE ||
+                       (recursion == RECURSION_TAIL && optimization_level >= 1);
+        size_t depth = 0;
+        for (size_t k = first; bounded && k < end; k++) {
+            uint32_t id = order[k];
+            uint32_t *calls = call_graph_calls(graph, id);
+            size_t num_calls = call_graph_degree(graph, id);
+            size_t frame = frame_size(frame_kind(num_calls));
+            if (frame > depth) {
+                depth = frame;
+            }
+            for (size_t j = 0; j < num_calls; j++) {
+                if (component[calls[j]] == component[id]) {
+                    continue; // A jump within the cycle, already counted
+                }
+                size_t callee = procs[calls[j]]->stack_depth;
+                if (callee == STACK_UNBOUNDED) {
+                    depth = STACK_UNBOUNDED;
+                    break;
+                }
+                size_t used = is_tail_call(num_calls, j) ? callee : frame + 8 + callee;
+                if (used > depth) {
+                    depth = used;
+                }
+            }
+        }
+
+        for (size_t k = first; k < end; k++) {
+            procs[order[k]]->stack_depth = bounded ? depth : STACK_UNBOUNDED;
+        }
+        first = end;
+    }
+
+    free(order);
+    free(component);
+}
+
+// --stack-report, for sizing the stacks binaries are run on
+void print_stack_report(Compiler* c) {
+    static const char *recursion_names[] = { "none", "tail", "recursive" };
+    int width = 9;
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        Procedure *proc = c->procedures.array[i];
+        if (proc->reachable && (int)proc->length > width) {
+            width = (int)proc->length;
+        }
+    }
+
+    printf("%-*s  %-9s  %5s  %s\n", width, "procedure", "recursion", "frame", "depth");
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        Procedure *proc = c->procedures.array[i];
+        if (!proc->reachable) {
+            continue;
+        }
+        size_t frame = frame_size(frame_kind(call_graph_degree(&c->graph, i)));
+        printf("%-*s  %-9s  %5zu  ", width, proc->name,
+               recursion_names[proc->recursion], frame);
+        if (proc->stack_depth == STACK_UNBOUNDED) {
+            printf("unbounded\n");
+        } else {
+            printf("%zu\n", proc->stack_depth);
+        }
+    }
+
+    // _start's call into main pushes one more return address
+    Procedure *main_proc = find_procedure_named(c, "main", 4);
+    if (main_proc->stack_depth == STACK_UNBOUNDED) {
+        printf("Stack needed: unbounded\n");
+    } else {
+        printf("Stack needed: %zu bytes\n", main_proc->stack_depth + 8);
+    }
+}
+
+static void emit_prologue(Emitter *out, Frame frame) {
+    switch (frame) {
+    case FRAME_POINTER:
+        emit_literal(out, "    push rbp\n");
+        emit_literal(out, "    mov rbp, rsp\n");
+        break;
+    case FRAME_PAD:
+        emit_literal(out, "    push rax\n");
+        break;
+    case FRAME_NONE:
+        break;
+    }
+}
+
+static void emit_epilogue(Emitter *out, Frame frame) {
+    switch (frame) {
+    case FRAME_POINTER:
+        emit_literal(out, "    mov rsp, rbp\n");
+        emit_literal(out, "    pop rbp\n");
+        break;
+    case FRAME_PAD:
+        emit_literal(out, "    pop rcx\n");
+        break;
+    case FRAME_NONE:
+        break;
+    }
+}
+
+// Procedure ID making NUM_CALLS calls to the ids in CALLS.
+static void emit_procedure(Compiler* c, Emitter *out, uint32_t id,
+                           uint32_t *calls, size_t num_calls) {
+    Procedure **procs = c->procedures.array;
+    Procedure *proc = procs[id];
+    Frame frame = frame_kind(num_calls);
+    emit_bytes(out, proc->name, proc->length);
+    emit_literal(out, ":\n");
+    emit_prologue(out, frame);
+
+    bool self_tail_call = ends_in_tail_call(num_calls) &&
+                          calls[num_calls - 1] == id;
+    if (self_tail_call) {
+        emit_literal(out, ".body:\n");
+    }
+
+    // Generate calls
+    for (size_t j = 0; j < num_calls; j++) {
+        Procedure *callee = procs[calls[j]];
+        if (!is_tail_call(num_calls, j)) {
+            emit_literal(out, "    call ");
+            emit_bytes(out, callee->name, callee->length);
+            emit_char(out, '\n');
+        } else if (callee == proc) {
+            // The frame is already set up, loop back into the body
+            emit_literal(out, "    jmp .body\n");
+        } else {
+            emit_epilogue(out, frame);
+            emit_literal(out, "    jmp ");
+            emit_bytes(out, callee->name, callee->length);
+            emit_char(out, '\n');
+        }
+    }
+
+    if (!ends_in_tail_call(num_calls)) {
+        emit_epilogue(out, frame);
+        emit_literal(out, "    ret\n");
+    }
+    emit_char(out, '\n');
+}
+
+// Parallel code generation
+// A procedure's code only depends on its own name and its callees', so
+// big programs are cut into chunks of CODEGEN_CHUNK ids that threads
+// take in turn, the way parse_worker takes files.
+#define CODEGEN_CHUNK 1024
+
+typedef struct {
+    Compiler *c;
+    CodeChunk *chunks;
+    size_t num_chunks;
+    void (*generate)(Compiler *c, CodeChunk *chunk);
+    atomic_size_t next; // Next chunk to hand out
+} CodegenQueue;
+
+static void *codegen_worker(void *arg) {
+    CodegenQueue *queue = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&queue->next, 1)) < queue->num_chunks) {
+        queue->generate(queue->c, &queue->chunks[i]);
+    }
+    return NULL;
+}
+
+// Run GENERATE over every procedure on up to codegen_jobs threads. One
+// chunk writes straight to OUT; several each get the slice of RELOCS
+// their calls need, and wait for stitch_chunk.
+static CodeChunk *generate_chunks(Compiler *c, Emitter *out, Relocation *relocs,
+                                  size_t *addresses, size_t *num_chunks,
+                                  void (*generate)(Compiler *c, CodeChunk *chunk)) {
+    size_t n = c->procedures.num;
+    size_t count = (n + CODEGEN_CHUNK - 1) / CODEGEN_CHUNK;
+    size_t jobs = codegen_jobs < count ? codegen_jobs : count;
+    if (jobs <= 1) {
+        count = 1;
+    }
+
+    CodeChunk *chunks = calloc(count, sizeof(CodeChunk));
+    size_t calls = 0;
+    for (size_t k = 0; k < count; k++) {
+        CodeChunk *chunk = &chunks[k];
+        chunk->first = count == 1 ? 0 : k * CODEGEN_CHUNK;
+        chunk->last = count == 1 || chunk->first + CODEGEN_CHUNK > n ? n
+                                                                      : chunk->first + CODEGEN_CHUNK;
+        chunk->relocs = relocs ? relocs + calls : NULL;
+        chunk->addresses = addresses;
+        for (size_t i = chunk->first; i < chunk->last; i++) {
+            if (c->procedures.array[i]->reachable) {
+                calls += call_graph_degree(&c->graph, i);
+            }
+        }
+
+        emitter_init(&chunk->own);
+        chunk->out = count == 1 ? out : &chunk->own;
+    }
+
+    if (count == 1) {
+        generate(c, &chunks[0]);
+    } else {
+        CodegenQueue queue = {.c = c, .chunks = chunks, .num_chunks = count,
+                              .generate = generate};
+        atomic_init(&queue.next, 0);
+        pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+        for (size_t i = 0; i < jobs; i++) {
+            pthread_create(&threads[i], NULL, codegen_worker, &queue);
+        }
+        for (size_t i = 0; i < jobs; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+    *num_chunks = count;
+    return chunks;
+}
+
+// Append CHUNK's code to OUT, returning where it landed. Chunks have
+// to come in order.
+static size_t stitch_chunk(CodeChunk *chunk, Emitter *out) {
+    if (chunk->out == out) {
+        return 0; // Written in place
+    }
+    size_t base = out->size;
+    if (chunk->own.size > 0) {
+        emit_bytes(out, chunk->own.data, chunk->own.size);
+    }
+    emitter_free(&chunk->own);
+    return base;
+}
+
+// Generate code for each procedure in CHUNK
+static void generate_asm_chunk(Compiler *c, CodeChunk *chunk) {
+    for (size_t i = chunk->first; i < chunk->last; i++) {
+        if (c->procedures.array[i]->reachable) {
+            emit_procedure(c, chunk->out, i, call_graph_calls(&c->graph, i),
+                           call_graph_degree(&c->graph, i));
+        }
+    }
+}
+
+void generate_code(Compiler* c) {
+    Emitter *out = &c->output;
+
+    // Write assembly header
+    emit_literal(out, "global _start\n\n");
+    emit_literal(out, "section .text\n\n");
+
+    size_t num_chunks;
+    CodeChunk *chunks = generate_chunks(c, out, NULL, NULL, &num_chunks,
+                                        generate_asm_chunk);
+    for (size_t k = 0; k < num_chunks; k++) {
+        stitch_chunk(&chunks[k], out);
+    }
+    free(chunks);
+
+    // Write _start function
+    emit_literal(out, "_start:\n");
+    emit_literal(out, "    call main\n");
+    emit_literal(out, "    mov rax, 60\n");
+    emit_literal(out, "    xor rdi, rdi\n");
+    emit_literal(out, "    syscall\n");
+}
+
+// Machine code backend
+#define ELF_BASE_ADDRESS 0x400000
+#define ELF_HEADERS_SIZE (sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr))
+
+static void emit_u32(Emitter *e, uint32_t value) {
+    char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+    emit_bytes(e, bytes, 4);
+}
+
+static void patch_u32(Emitter *e, size_t offset, uint32_t value) {
+    e->data[offset]     = value;
+    e->data[offset + 1] = value >> 8;
+    e->data[offset + 2] = value >> 16;
+    e->data[offset + 3] = value >> 24;
+}
+
+// Emit OPCODE with a zero rel32, recording where it should point.
+static void emit_branch(Emitter *e, Relocation *relocs, size_t *num_relocs,
+                        char opcode, size_t target, size_t addend) {
+    emit_char(e, opcode);
+    relocs[*num_relocs].offset = e->size;
+    relocs[*num_relocs].target = target;
+    relocs[*num_relocs].addend = addend;
+    (*num_relocs)++;
+    emit_u32(e, 0);
+}
+
+#define OP_CALL 0xe8
+#define OP_JMP  0xe9
+
+// Machine code versions of emit_prologue/emit_epilogue, returning the
+// number of bytes written.
+static size_t encode_prologue(Emitter *out, Frame frame) {
+    switch (frame) {
+    case FRAME_POINTER:
+        emit_bytes(out, "\x55\x48\x89\xe5", 4); // push rbp; mov rbp, rsp
+        return 4;
+    case FRAME_PAD:
+        emit_bytes(out, "\x50", 1); // push rax
+        return 1;
+    case FRAME_NONE:
+        break;
+    }
+    return 0;
+}
+
+static void encode_epilogue(Emitter *out, Frame frame) {
+    switch (frame) {
+    case FRAME_POINTER:
+        emit_bytes(out, "\x48\x89\xec\x5d", 4); // mov rsp, rbp; pop rbp
+        break;
+    case FRAME_PAD:
+        emit_bytes(out, "\x59", 1); // pop rcx
+        break;
+    case FRAME_NONE:
+        break;
+    }
+}
+
+static void encode_procedure(Emitter *out, uint32_t id, uint32_t *calls,
+                             size_t num_calls, Relocation *relocs,
+                             size_t *num_relocs) {
+    Frame frame = frame_kind(num_calls);
+    size_t prologue_size = encode_prologue(out, frame);
+
+    for (size_t j = 0; j < num_calls; j++) {
+        if (!is_tail_call(num_calls, j)) {
+            emit_branch(out, relocs, num_relocs, OP_CALL, calls[j], 0);
+        } else if (calls[j] == id) {
+            emit_branch(out, relocs, num_relocs, OP_JMP, id, prologue_size);
+        } else {
+            encode_epilogue(out, frame);
+            emit_branch(out, relocs, num_relocs, OP_JMP, calls[j], 0);
+        }
+    }
+
+    if (!ends_in_tail_call(num_calls)) {
+        encode_epilogue(out, frame);
+        emit_bytes(out, "\xc3", 1); // ret
+    }
+}
+
+// Encode the procedures in CHUNK. Addresses and
+// relocations are offsets into the chunk's out.
+static void generate_machine_chunk(Compiler *c, CodeChunk *chunk) {
+    size_t num_relocs = 0;
+    for (size_t i = chunk->first; i < chunk->last; i++) {
+        if (c->procedures.array[i]->reachable) {
+            chunk->addresses[i] = chunk->out->size;
+            encode_procedure(chunk->out, i, call_graph_calls(&c->graph, i),
+                             call_graph_degree(&c->graph, i), chunk->relocs, &num_relocs);
+        }
+    }
+    chunk->num_relocs = num_relocs;
+}
+
+// Same program as generate_code, encoded directly. Expects optimize()
+// to have run. Offsets in
+// Compiler.code are relative to the start of the text, which is placed
+// right after the ELF headers by write_executable. The entry point is
+// stored in Compiler.code_entry.
+bool generate_machine_code(Compiler* c) {
+    Emitter *out = &c->code;
+    size_t num_calls = 1; // _start calls main
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        if (c->procedures.array[i]->reachable) {
+            num_calls += call_graph_degree(&c->graph, i);
+        }
+    }
+
+    size_t *addresses = arena_alloc(&c->arena, c->procedures.num * sizeof(size_t));
+    Relocation *relocs = arena_alloc(&c->arena, num_calls * sizeof(Relocation));
+    size_t num_relocs = 0;
+
+    // Move each chunk's code and relocations in after the one before. A
+    // chunk's slice never starts before num_relocs, so they only move down.
+    size_t num_chunks;
+    CodeChunk *chunks = generate_chunks(c, out, relocs, addresses, &num_chunks,
+                                        generate_machine_chunk);
+    for (size_t k = 0; k < num_chunks; k++) {
+        CodeChunk *chunk = &chunks[k];
+        size_t base = stitch_chunk(chunk, out);
+        for (size_t i = chunk->first; base > 0 && i < chunk->last; i++) {
+            if (c->procedures.array[i]->reachable) {
+                addresses[i] += base;
+            }
+        }
+        for (size_t r = 0; r < chunk->num_relocs; r++) {
+            chunk->relocs[r].offset += base;
+        }
+        memmove(relocs + num_relocs, chunk->relocs, chunk->num_relocs * sizeof(Relocation));
+        num_relocs += chunk->num_relocs;
+    }
+    free(chunks);
+
+    Procedure *main_proc = find_procedure_named(c, "main", 4);
+    if (!main_proc || !main_proc->reachable) {
+        fprintf(stderr, "Error: No 'main' procedure defined\n");
+        return false;
+    }
+
+    c->code_entry = out->size;
+    emit_branch(out, relocs, &num_relocs, OP_CALL, main_proc->id, 0);
+    emit_bytes(out, "\x48\xc7\xc0\x3c\x00\x00\x00", 7); // mov rax, 60
+    emit_bytes(out, "\x48\x31\xff", 3);                 // xor rdi, rdi
+    emit_bytes(out, "\x0f\x05", 2);                      // syscall
+
+    // Resolve calls now that every procedure has an address
+    for (size_t i = 0; i < num_relocs; i++) {
+        size_t next = relocs[i].offset + 4;
+        size_t target = addresses[relocs[i].target] + relocs[i].addend;
+        patch_u32(out, relocs[i].offset, (uint32_t)(target - next));
+    }
+    return true;
+}
+
+// Headers for CODE_SIZE bytes of text entered at CODE_ENTRY.
+static void elf_headers(Elf64_Ehdr *headers, Elf64_Phdr *segment, size_t code_size,
+                        size_t code_entry) {
+    size_t file_size = ELF_HEADERS_SIZE + code_size;
+
+    Elf64_Ehdr ehdr = {0};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = ELF_BASE_ADDRESS + ELF_HEADERS_SIZE + code_entry;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = 1;
+
+    Elf64_Phdr phdr = {0};
+    phdr.p_type = PT_LOAD;
+    phdr.p_flags = PF_R | PF_X;
+    phdr.p_offset = 0;
+    phdr.p_vaddr = ELF_BASE_ADDRESS;
+    phdr.p_paddr = ELF_BASE_ADDRESS;
+    phdr.p_filesz = file_size;
+    phdr.p_memsz = file_size;
+    phdr.p_align = 0x1000;
+
+    *headers = ehdr;
+    *segment = phdr;
+}
+
+// Write Compiler.code as a static ELF64 executable with a single
+// read/execute segment holding the headers and the text.
+bool write_executable(Compiler* c, const char *path) {
+    size_t file_size = ELF_HEADERS_SIZE + c->code.size;
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+    elf_headers(&ehdr, &phdr, c->code.size, c->code_entry);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not create output file '%s'\n", path);
+        return false;
+    }
+
+    struct iovec parts[] = {
+        {.iov_base = &ehdr, .iov_len = sizeof(ehdr)},
+        {.iov_base = &phdr, .iov_len = sizeof(phdr)},
+        {.iov_base = c->code.data, .iov_len = c->code.size},
+    };
+    ssize_t written = writev(fd, parts, 3);
+    close(fd);
+    if (written != (ssize_t)file_size) {
+        fprintf(stderr, "Error: Failed to write '%s'\n", path);
+        return false;
+    }
+    return true;
+}
+
+// Streaming compiler
+// --stream: each procedure is compiled as soon as its closing brace is
+// parsed, and its calls are dropped once its code is out. No token
+// history is kept and the output is written as it grows, so memory goes
+// with the procedure table and the biggest body rather than the input.
+// Without the whole call graph nothing can be left out or inlined, so
+// every defined procedure is emitted, the same as -O1 at most.
+#define STREAM_FLUSH_SIZE (64 * 1024)
+#define STREAM_RELEASE_SIZE (1024 * 1024)
+
+typedef struct {
+    Compiler *c;
+    bool machine_code;
+    int fd;
+    const char *path;
+    Emitter out;          // Not written to fd yet
+    size_t flushed;       // Bytes written to fd before out
+    size_t released;      // Source bytes given back to the kernel
+    size_t *addresses;    // Text offset by procedure id, SIZE_MAX until emitted
+    size_t num_addresses;
+    Relocation *pending;  // Calls to procedures not emitted yet, by file offset
+    size_t num_pending;
+    size_t pending_capacity;
+    Relocation *relocs;   // Scratch for the procedure being encoded
+    size_t relocs_capacity;
+    uint32_t *calls;      // Scratch, its calls as ids
+} Stream;
+
+static bool stream_flush(Stream *s) {
+    size_t written = 0;
+    while (written < s->out.size) {
+        ssize_t n = write(s->fd, s->out.data + written, s->out.size - written);
+        if (n < 0) {
+            fprintf(stderr, "Error: Failed to write '%s'\n", s->path);
+            return false;
+        }
+        written += n;
+    }
+    s->flushed += s->out.size;
+    s->out.size = 0;
+    return true;
+}
+
+// Offset into the text of what is at out.data[offset].
+static size_t stream_text_offset(Stream *s, size_t offset) {
+    return s->flushed + offset - ELF_HEADERS_SIZE;
+}
+
+// Resolve calls to procedures already placed, keep the rest for later.
+static void stream_relocate(Stream *s, size_t num_relocs) {
+    for (size_t r = 0; r < num_relocs; r++) {
+        Relocation reloc = s->relocs[r];
+        if (reloc.target < s->num_addresses && s->addresses[reloc.target] != SIZE_MAX) {
+            size_t next = stream_text_offset(s, reloc.offset) + 4;
+            size_t target = s->addresses[reloc.target] + reloc.addend;
+            patch_u32(&s->out, reloc.offset, (uint32_t)(target - next));
+            continue;
+        }
+        if (s->num_pending >= s->pending_capacity) {
+            s->pending_capacity = s->pending_capacity == 0 ? 64 : s->pending_capacity * 2;
+            s->pending = realloc(s->pending, s->pending_capacity * sizeof(Relocation));
+        }
+        reloc.offset += s->flushed;
+        s->pending[s->num_pending++] = reloc;
+    }
+}
+
+static void stream_procedure(Stream *s, Procedure *proc) {
+    Compiler *c = s->c;
+    size_t num_calls = proc->num_calls;
+    if (num_calls + 1 > s->relocs_capacity) {
+        s->relocs_capacity = (num_calls + 1) * 2;
+        s->relocs = realloc(s->relocs, s->relocs_capacity * sizeof(Relocation));
+        s->calls = realloc(s->calls, s->relocs_capacity * sizeof(uint32_t));
+    }
+    for (size_t j = 0; j < num_calls; j++) {
+        s->calls[j] = proc->calls[j]->id;
+    }
+
+    if (!s->machine_code) {
+        emit_procedure(c, &s->out, proc->id, s->calls, num_calls);
+    } else {
+        if (c->procedures.num > s->num_addresses) {
+            size_t old = s->num_addresses;
+            s->num_addresses = c->procedures.capacity;
+            s->addresses = realloc(s->addresses, s->num_addresses * sizeof(size_t));
+            for (size_t i = old; i < s->num_addresses; i++) {
+                s->addresses[i] = SIZE_MAX;
+            }
+        }
+        s->addresses[proc->id] = stream_text_offset(s, s->out.size);
+        size_t num_relocs = 0;
+        encode_procedure(&s->out, proc->id, s->calls, num_calls, s->relocs, &num_relocs);
+        stream_relocate(s, num_relocs);
+    }
+
+    // The body is out, only the name has to stay
+    proc->calls = NULL;
+    proc->num_calls = 0;
+    proc->calls_capacity = 0;
+    arena_reset(&c->bodies);
+}
+
+// Every procedure is in, write _start and settle the calls that were
+// made before their target was emitted.
+static bool stream_finish(Stream *s) {
+    Compiler *c = s->c;
+    bool ok = true;
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        Procedure *proc = c->procedures.array[i];
+        if (!proc->defined && proc->num_references > 0) {
+            fprintf(stderr, "%s: Error: Procedure '%s' is called but never defined\n",
+                    c->buffer.name, proc->name);
+            ok = false;
+        }
+    }
+    Procedure *main_proc = find_procedure_named(c, "main", 4);
+    if (!main_proc || !main_proc->defined) {
+        fprintf(stderr, "%s: Error: No 'main' procedure defined\n", c->buffer.name);
+        ok = false;
+    }
+    if (!ok) {
+        return false;
+    }
+
+    if (!s->machine_code) {
+        emit_literal(&s->out, "_start:\n");
+        emit_literal(&s->out, "    call main\n");
+        emit_literal(&s->out, "    mov rax, 60\n");
+        emit_literal(&s->out, "    xor rdi, rdi\n");
+        emit_literal(&s->out, "    syscall\n");
+        return stream_flush(s);
+    }
+
+    size_t code_entry = stream_text_offset(s, s->out.size);
+    size_t num_relocs = 0;
+    emit_branch(&s->out, s->relocs, &num_relocs, OP_CALL, main_proc->id, 0);
+    emit_bytes(&s->out, "\x48\xc7\xc0\x3c\x00\x00\x00", 7); // mov rax, 60
+    emit_bytes(&s->out, "\x48\x31\xff", 3);                 // xor rdi, rdi
+    emit_bytes(&s->out, "\x0f\x05", 2);                      // syscall
+    stream_relocate(s, num_relocs);
+    if (!stream_flush(s)) {
+        return false;
+    }
+
+    // Headers and forward calls go in through a mapping of the file
+    char *file = mmap(NULL, s->flushed, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (file == MAP_FAILED) {
+        fprintf(stderr, "Error: Failed to write '%s'\n", s->path);
+        return false;
+    }
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+    elf_headers(&ehdr, &phdr, s->flushed - ELF_HEADERS_SIZE, code_entry);
+    memcpy(file, &ehdr, sizeof(ehdr));
+    memcpy(file + sizeof(ehdr), &phdr, sizeof(phdr));
+    Emitter text = {.data = file, .size = s->flushed, .capacity = s->flushed};
+    for (size_t i = 0; i < s->num_pending; i++) {
+        Relocation reloc = s->pending[i];
+        size_t next = reloc.offset - ELF_HEADERS_SIZE + 4;
+        size_t target = s->addresses[reloc.target] + reloc.addend;
+        patch_u32(&text, reloc.offset, (uint32_t)(target - next));
+    }
+    munmap(file, s->flushed);
+    return true;
+}
+
+// Compile C's buffer in one pass, to the assembly file or executable
+// PATH ('-' being stdout for assembly). MAPPED says the buffer is a
+// file mapping, whose pages are dropped once they are parsed.
+bool stream_program(Compiler *c, const char *path, bool machine_code, bool mapped) {
+    Stream s = {.c = c, .machine_code = machine_code, .path = path};
+    bool to_stdout = strcmp(path, "-") == 0;
+    s.fd = to_stdout ? STDOUT_FILENO
+                     : open(path, O_RDWR | O_CREAT | O_TRUNC, machine_code ? 0755 : 0644);
+    if (s.fd < 0) {
+        fprintf(stderr, "Error: Could not create output file '%s'\n", path);
+        return false;
+    }
+    emitter_init(&s.out);
+    if (machine_code) {
+        char headers[ELF_HEADERS_SIZE] = {0}; // Filled in by stream_finish
+        emit_bytes(&s.out, headers, sizeof(headers));
+    } else {
+        emit_literal(&s.out, "global _start\n\n");
+        emit_literal(&s.out, "section .text\n\n");
+    }
+
+    // Parse errors have to get past here to remove the partial output
+    jmp_buf recover;
+    jmp_buf *outer = c->recover;
+    c->recover = &recover;
+    c->streaming = true;
+    bool ok = true;
+    bool failed = setjmp(recover) != 0;
+    if (!failed) {
+        lex(c); // Get the first token
+        while (ok && c->current_token.type != TOKEN_EOF) {
+            stream_procedure(&s, parse_procedure(c));
+            if (s.out.size >= STREAM_FLUSH_SIZE) {
+                ok = stream_flush(&s);
+            }
+            size_t done = c->cursor.point & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+            if (mapped && done - s.released >= STREAM_RELEASE_SIZE) {
+                madvise((char *)c->buffer.content + s.released, done - s.released,
+                        MADV_DONTNEED);
+                s.released = done;
+            }
+        }
+        ok = ok && stream_finish(&s);
+    }
+    c->recover = outer;
+    c->streaming = false;
+
+    if (!to_stdout) {
+        close(s.fd);
+        if (failed || !ok) {
+            unlink(path);
+        }
+    }
+    emitter_free(&s.out);
+    free(s.addresses);
+    free(s.pending);
+    free(s.relocs);
+    free(s.calls);
+    if (failed) {
+        cursor_jump(&c->cursor, &c->buffer, c->error_point);
+        error(c, c->error_message);
+    }
+    return ok;
+}
+
+// --stream for the file at PATH, with emit_program's choice of outputs.
+bool stream_file(const char *path, const char *asm_file_name, bool emit_asm) {
+    char *source;
+    size_t size;
+    bool mapped;
+    if (!read_file(path, &source, &size, &mapped)) {
+        return false;
+    }
+    Compiler *c = compiler_new(source, size);
+    compiler_set_name(c, path);
+
+    bool ok;
+    if (asm_file_name) {
+        ok = stream_program(c, asm_file_name, false, mapped);
+    } else if (emit_asm) {
+        ok = stream_program(c, "output.asm", false, mapped) &&
+             system("nasm -f elf64 output.asm") == 0 &&
+             system("ld -o a.out output.o") == 0;
+    } else {
+        ok = stream_program(c, "a.out", true, mapped);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Error: Compilation failed\n");
+    } else if (!asm_file_name) {
+        printf("Compilation successful. Executable 'a.out' created.\n");
+    }
+    compiler_free(c);
+    release_file(source, size, mapped);
+    return ok;
+}
+
+void error(Compiler* c, const char* message) {
+    if (c->recover) {
+        c->error_message = message;
+        c->error_point = c->cursor.point;
+        longjmp(*c->recover, 1);
+    }
+    Position pos = buffer_position(&c->buffer, c->cursor.point);
+    fprintf(stderr, "%s: Error at line %zu, column %zu: %s\n", c->buffer.name,
+            pos.row, pos.col, message);
+    exit(1);
+}
+
+#include <lume.h>
+
+int sw = 1920;
+int sh = 1080;
+
+void drawCompilerState(Font *font, Compiler *c, int step_count) {
+    char state_info[256];
+    Span lexeme = c->current_token.lexeme;
+    Position pos = buffer_position(&c->buffer, c->cursor.point);
+
+    snprintf(state_info, sizeof(state_info),
+             "Step: %d, Token: %.*s, Line: %zu, Col: %zu", step_count,
+             (int)lexeme.length, span_text(&c->buffer, lexeme),
+             pos.row, pos.col);
+
+    drawText(font, state_info, 10, 40, CT.text);
+}
+
+// What each FaceClass looks like in the current theme.
+void themePalette(Color palette[NUM_FACES]) {
+    palette[FACE_TEXT] = CT.text;
+    palette[FACE_BACKGROUND] = CT.bg;
+    palette[FACE_VARIABLE] = CT.variable;
+    palette[FACE_FUNCTION] = CT.function;
+    palette[FACE_KEYWORD] = CT.keyword;
+    palette[FACE_PREPROCESSOR] = CT.preprocessor;
+    palette[FACE_TYPE] = CT.type;
+}
+
+// Glyph cache
+// Between frames the step mode text only changes color. Its layout and
+// faces are kept per character and a step recolors just the glyphs
+// of the old and new token and cursor, so a frame is one pass handing
+// cached quads to the batch flush() submits. Faces go through the
+// palette as they are drawn, so a theme switch costs nothing here.
+typedef struct {
+    float x;      // From the start of the text
+    float y;
+    uint8_t face; // FaceClass
+} Glyph;
+
+typedef struct {
+    Glyph *glyphs;       // One per byte of the buffer, newlines included,
+                         // plus where the next one would go
+    size_t count;
+    const char *text;    // What the layout is for
+    Font *font;
+    float advances[256]; // Width of each byte in font
+    bool colored;        // Faces are set for this layout
+    bool singleHighlight;
+    Span token;          // Current token when last colored
+    size_t point;        // Cursor when last colored
+    size_t tokens;       // History tokens colored, when highlighting all
+} GlyphCache;
+
+static GlyphCache glyphCache = {0};
+
+static bool span_contains(Span span, size_t i) {
+    return i >= span.start && i < span.start + span.length;
+}
+
+// What drawBuffer colors character I of the buffer.
+static FaceClass glyphFace(Compiler *c, size_t i) {
+    if (i == c->cursor.point) {
+        return FACE_BACKGROUND; // Highlight color for cursor position
+    }
+    if (single_highlight_mode) {
+        // Only highlight the current token
+        if (span_contains(c->current_token.lexeme, i)) {
+            return c->current_token.face.fg;
+        }
+        return FACE_TEXT;
+    }
+
+    // Highlight all tokens, the last one starting at or before I
+    TokenHistory *history = &c->history;
+    size_t lo = 0, hi = history->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (history->tokens[mid].lexeme.start <= i) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0 && span_contains(history->tokens[lo - 1].lexeme, i)) {
+        return history->tokens[lo - 1].face.fg;
+    }
+    return FACE_TEXT;
+}
+
+static void recolorGlyphs(GlyphCache *cache, Compiler *c, size_t start, size_t end) {
+    end = end < cache->count ? end : cache->count;
+    for (size_t i = start; i < end; i++) {
+        cache->glyphs[i].face = glyphFace(c, i);
+    }
+}
+
+// Lay the buffer out again if it or the font changed. Positions are
+// running sums of the advances along each line.
+static void layoutGlyphs(GlyphCache *cache, Compiler *c, Font *font) {
+    const char *text = c->buffer.content;
+    if (cache->text == text && cache->count == c->buffer.size && cache->font == font) {
+        return;
+    }
+    if (cache->font != font) {
+        for (int ch = 0; ch < 256; ch++) {
+            cache->advances[ch] = getCharacterWidth(font, (char)ch);
+        }
+    }
+    cache->glyphs = realloc(cache->glyphs, (c->buffer.size + 1) * sizeof(Glyph));
+    cache->count = c->buffer.size;
+    cache->text = text;
+    cache->font = font;
+    cache->colored = false;
+
+    float x = 0;
+    float y = 0;
+    for (size_t i = 0; i < cache->count; i++) {
+        cache->glyphs[i].x = x;
+        cache->glyphs[i].y = y;
+        if (text[i] == '\n') {
+            x = 0;
+            y -= (font->ascent + font->descent);
+        } else {
+            x += cache->advances[(unsigned char)text[i]];
+        }
+    }
+    cache->glyphs[cache->count] = (Glyph){.x = x, .y = y, .face = FACE_TEXT};
+}
+
+// Where the glyph at POINT goes, POINT being at most the buffer size.
+static Glyph *glyphAt(GlyphCache *cache, Compiler *c, Font *font, size_t point) {
+    layoutGlyphs(cache, c, font);
+    return &cache->glyphs[point];
+}
+
+// Bring the cached colors up to date with C.
+static void updateGlyphs(GlyphCache *cache, Compiler *c, Font *font) {
+    layoutGlyphs(cache, c, font);
+
+    if (!cache->colored || cache->singleHighlight != single_highlight_mode ||
+        c->history.count < cache->tokens) {
+        recolorGlyphs(cache, c, 0, cache->count);
+    } else {
+        Span token = c->current_token.lexeme;
+        recolorGlyphs(cache, c, cache->token.start, cache->token.start + cache->token.length);
+        recolorGlyphs(cache, c, token.start, token.start + token.length);
+        recolorGlyphs(cache, c, cache->point, cache->point + 1);
+        recolorGlyphs(cache, c, c->cursor.point, c->cursor.point + 1);
+        if (!single_highlight_mode && c->history.count > cache->tokens) {
+            Span last = c->history.tokens[c->history.count - 1].lexeme;
+            recolorGlyphs(cache, c, c->history.tokens[cache->tokens].lexeme.start,
+                          last.start + last.length);
+        }
+    }
+
+    cache->colored = true;
+    cache->singleHighlight = single_highlight_mode;
+    cache->token = c->current_token.lexeme;
+    cache->point = c->cursor.point;
+    cache->tokens = c->history.count;
+}
+
+void drawBuffer(Compiler *c, Font *font, float startX, float startY,
+                float scrollX, float scrollY) {
+    if (!c || !font || !c->buffer.content)
+        return;
+
+    updateGlyphs(&glyphCache, c, font);
+
+    const char *text = c->buffer.content;
+    float x = startX - scrollX;
+    float y = startY + scrollY;
+    Glyph *glyphs = glyphCache.glyphs;
+    LineIndex *lines = &c->buffer.lines;
+    Color palette[NUM_FACES];
+    themePalette(palette);
+
+    // Only the lines and columns inside the window, one line of slack
+    // either side for glyphs that hang over the edge
+    float lineHeight = font->ascent + font->descent;
+    float above = (y - sh) / lineHeight;
+    size_t first = above > 1 ? (size_t)above - 1 : 0;
+    size_t last = y > 0 ? (size_t)(y / lineHeight) + 2 : 1;
+    last = last < lines->count ? last : lines->count;
+    float left = scrollX - lineHeight;
+    float right = scrollX + sw;
+
+    useShader("text");
+    for (size_t line = first; line < last; line++) {
+        size_t start = lines->starts[line];
+        size_t end = line + 1 < lines->count ? lines->starts[line + 1] : c->buffer.size;
+
+        // Glyphs on a line go left to right, skip to the first in view
+        size_t lo = start, hi = end;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (glyphs[mid].x < left) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (size_t i = lo; i < end && glyphs[i].x < right; i++) {
+            if (text[i] != '\n') {
+                drawChar(font, text[i], x + glyphs[i].x, y + glyphs[i].y, 1.0, 1.0,
+                         palette[glyphs[i].face]);
+            }
+        }
+    }
+    flush();
+}
+
+/* void drawBuffer(Compiler *c, Font *font, float startX, float startY, */
+/*                 float scrollX, float scrollY) { */
+/*     if (!c || !font || !c->buffer.content) */
+/*         return; */
+
+/*     const char *text = c->buffer.content; */
+/*     float x = startX - scrollX; */
+/*     float y = startY + scrollY; */
+/*     size_t charIndex = 0; */
+/*     size_t tokenIndex = 0; */
+
+/*     useShader("text"); */
+
+/*     while (charIndex < c->buffer.size) { */
+/*         if (text[charIndex] == '\n') { */
+/*             x = startX - scrollX; */
+/*             y -= (font->ascent + font->descent); */
+/*             charIndex++; */
+/*             continue; */
+/*         } */
+
+/*         Color currentColor = CT.text; // Default color */
+
+/*         if (single_highlight_mode) { */
+/*             // Only highlight the current token */
+/*             if (charIndex >= c->current_token.face.start && */
+/*                 charIndex < c->current_token.face.end) { */
+/*                 currentColor = c->current_token.face.fg; */
+/*             } */
+/*         } else { */
+/*             // Highlight all tokens */
+/*             while (tokenIndex < c->history.count && */
+/*                    charIndex >= c->history.tokens[tokenIndex].face.end) { */
+/*                 tokenIndex++; */
+/*             } */
+
+/*             if (tokenIndex < c->history.count && */
+/*                 charIndex >= c->history.tokens[tokenIndex].face.start && */
+/*                 charIndex < c->history.tokens[tokenIndex].face.end) { */
+/*                 currentColor = c->history.tokens[tokenIndex].face.fg; */
+/*             } */
+/*         } */
+
+/*         drawChar(font, text[charIndex], x, y, 1.0, 1.0, currentColor); */
+
+/*         x += getCharacterWidth(font, text[charIndex]); */
+/*         charIndex++; */
+/*     } */
+
+/*     flush(); */
+/* } */
+
+/* void drawBuffer(Compiler *c, Font *font, float startX, float startY, */
+/*                 float scrollX, float scrollY) { */
+/*     if (!c || !font || !c->buffer.content) */
+/*         return; */
+
+/*     const char *text = c->buffer.content; */
+/*     float x = startX - scrollX; */
+/*     float y = startY + scrollY; */
+/*     size_t charIndex = 0; */
+/*     size_t tokenIndex = 0; */
+
+/*     useShader("text"); */
+
+/*     while (charIndex < c->buffer.size) { */
+/*         if (text[charIndex] == '\n') { */
+/*             x = startX - scrollX; */
+/*             y -= (font->ascent + font->descent); */
+/*             charIndex++; */
+/*             continue; */
+/*         } */
+
+/*         Color currentColor = CT.text; // Default color */
+
+/*         // Find the current token */
+/*         while (tokenIndex < c->history.count && */
+/*                charIndex >= c->history.tokens[tokenIndex].face.end) { */
+/*             tokenIndex++; */
+/*         } */
+
+/*         if (tokenIndex < c->history.count && */
+/*             charIndex >= c->history.tokens[tokenIndex].face.start && */
+/*             charIndex < c->history.tokens[tokenIndex].face.end) { */
+/*             currentColor = c->history.tokens[tokenIndex].face.fg; */
+/*         } */
+
+/*         drawChar(font, text[charIndex], x, y, 1.0, 1.0, currentColor); */
+
+/*         x += getCharacterWidth(font, text[charIndex]); */
+/*         charIndex++; */
+/*     } */
+
+/*     flush(); */
+/* } */
+
+void drawCursor(Compiler *c, Font *font, float startX, float startY,
+                float scrollX, float scrollY, Color cursorColor) {
+    Glyph *glyph = glyphAt(&glyphCache, c, font, c->cursor.point);
+    float cursorX = startX - scrollX + glyph->x;
+    float cursorY = startY + scrollY + glyph->y;
+
+    float cursorWidth =
+        (c->cursor.point < c->buffer.size &&
+         c->buffer.content[c->cursor.point] != '\n')
+        ? glyphCache.advances[(unsigned char)c->buffer.content[c->cursor.point]]
+        : glyphCache.advances[' '];
+
+    cursorY -= font->descent * 2;
+
+    Vec2f cursorPosition = {cursorX, cursorY};
+    Vec2f cursorSize = {cursorWidth, font->ascent + font->descent};
+
+    useShader("simple");
+    drawRectangle(cursorPosition, cursorSize, cursorColor);
+    flush();
+}
+
+int  fontsize    = 82;
 char *fontPath   = "fan.otf";
-bool should_step = false;
 int  step_count  = 0;
+bool needs_redraw = true;      // Something on screen changed
+bool continuous_redraw = false; // --continuous, for animated shaders
+float scrollX    = 0;
+float scrollY    = 0;
+
+#define SCROLL_MARGIN 3 // Lines kept between the cursor and the edge
+
+// Scroll just enough to keep the cursor SCROLL_MARGIN lines inside the
+// window vertically and in view horizontally.
+void followCursor(Compiler *c, Font *font) {
+    float lineHeight = font->ascent + font->descent;
+    size_t visible = sh / lineHeight > 1 ? (size_t)(sh / lineHeight) : 1;
+    size_t margin = SCROLL_MARGIN < (visible - 1) / 2 ? SCROLL_MARGIN : (visible - 1) / 2;
+    Position pos = buffer_position(&c->buffer, c->cursor.point);
+
+    size_t top = (size_t)(scrollY / lineHeight + 0.5f);
+    if (pos.line < top + margin) {
+        top = pos.line > margin ? pos.line - margin : 0;
+    } else if (pos.line + margin >= top + visible) {
+        top = pos.line + margin + 1 - visible;
+    }
+    scrollY = top * lineHeight;
+
+    float cursorX = glyphAt(&glyphCache, c, font, c->cursor.point)->x;
+    float slack = 4 * glyphCache.advances[' '];
+    if (cursorX < scrollX || cursorX + slack > scrollX + sw) {
+        scrollX = cursorX > sw / 2 ? cursorX - sw / 2 : 0;
+    }
+}
+
+// Step mode navigation
+// Every token lexed so far stays in the history and the lexer keeps no
+// state besides its cursor, so the history already is a checkpoint per
+// token: going back restores the cursor to where the target token ends,
+// going forward lexes on from wherever the lexer is.
+typedef enum {
+    MOVE_NONE,
+    MOVE_STEP, // Forward by the repeat count
+    MOVE_BACK, // Back by the repeat count
+    MOVE_PROC, // Forward to the next 'proc'
+    MOVE_LINE  // To the first token on line repeat count, or the end
+} Move;
+
+Move pending_move = MOVE_NONE;
+long repeat_count = 0; // Digits typed before a move, vi style
+#define REPEAT_MAX 1000000000L // More digits stick here, moves stop at the ends anyway
+
+// Make the history hold TOKENS tokens, the last one current.
+void seekToken(Compiler *c, size_t tokens) {
+    tokens = tokens > 0 ? tokens : 1;
+    if (tokens < c->history.count) {
+        c->history.count = tokens;
+        c->current_token = c->history.tokens[tokens - 1];
+        Span lexeme = c->current_token.lexeme;
+        cursor_jump(&c->cursor, &c->buffer, lexeme.start + lexeme.length);
+    }
+    while (c->history.count < tokens && c->current_token.type != TOKEN_EOF) {
+        lex(c);
+    }
+}
+
+// Go to the first token at or after POINT.
+static void seekPoint(Compiler *c, size_t point) {
+    TokenHistory *history = &c->history;
+    if (history->count > 0 && history->tokens[history->count - 1].lexeme.start >= point) {
+        size_t lo = 0, hi = history->count - 1;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (history->tokens[mid].lexeme.start < point) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        seekToken(c, lo + 1);
+        return;
+    }
+    while (c->current_token.lexeme.start < point && c->current_token.type != TOKEN_EOF) {
+        lex(c);
+    }
+}
+
+// Carry out pending_move. Returns false when asked to go forward from EOF.
+bool applyMove(Compiler *c) {
+    size_t count = repeat_count > 0 ? repeat_count : 1;
+    bool at_end = c->current_token.type == TOKEN_EOF;
+    switch (pending_move) {
+    case MOVE_NONE:
+        break;
+    case MOVE_STEP:
+        seekToken(c, c->history.count + count);
+        break;
+    case MOVE_BACK:
+        seekToken(c, c->history.count > count ? c->history.count - count : 1);
+        break;
+    case MOVE_PROC:
+        while (c->current_token.type != TOKEN_EOF) {
+            lex(c);
+            if (c->current_token.type == TOKEN_PROC) {
+                break;
+            }
+        }
+        break;
+    case MOVE_LINE:
+        if (repeat_count > 0 && (size_t)repeat_count <= c->buffer.lines.count) {
+            seekPoint(c, c->buffer.lines.starts[repeat_count - 1]);
+        } else {
+            seekPoint(c, c->buffer.size);
+        }
+        break;
+    }
+    bool moved = !(at_end && (pending_move == MOVE_STEP || pending_move == MOVE_PROC));
+    step_count = c->history.count - 1;
+    pending_move = MOVE_NONE;
+    repeat_count = 0;
+    return moved;
+}
+
+void keyCallback(int key, int action, int mods) {
+    bool shiftPressed = mods & GLFW_MOD_SHIFT;
+    bool ctrlPressed = mods & GLFW_MOD_CONTROL;
+    bool altPressed = mods & GLFW_MOD_ALT;
+    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
+        needs_redraw = true;
+        if (key >= KEY_0 && key <= KEY_9) {
+            if (repeat_count <= (REPEAT_MAX - 9) / 10) {
+                repeat_count = repeat_count * 10 + (key - KEY_0);
+            } else {
+                repeat_count = REPEAT_MAX;
+            }
+            return;
+        }
+        switch (key) {
+        case KEY_J:
+        case KEY_N:
+        case KEY_SPACE:
+        case KEY_F:
+            pending_move = MOVE_STEP;
+            break;
+        case KEY_K:
+        case KEY_B:
+            pending_move = MOVE_BACK;
+            break;
+        case KEY_P:
+            pending_move = MOVE_PROC;
+            break;
+        case KEY_G:
+            pending_move = MOVE_LINE;
+            break;
+        case KEY_ESCAPE:
+            repeat_count = 0;
+            break;
+        case KEY_MINUS:
+            previousTheme();
+          break;
+        case KEY_H:
+            single_highlight_mode = !single_highlight_mode;
+          break;
+        case KEY_EQUAL:
+            nextTheme();
+          break;
+        }
+    }
+}
+
+// Read FILE into memory until EOF, for pipes and other streams that
+// can't be mapped or sized up front.
+static bool read_stream(FILE *file, char **content, size_t *size) {
+    size_t capacity = 4096;
+    *size = 0;
+    *content = malloc(capacity);
+    if (!*content) {
+        fprintf(stderr, "Error: Memory allocation failed\n");
+        return false;
+    }
+
+    size_t read_size;
+    while ((read_size = fread(*content + *size, 1, capacity - *size, file)) > 0) {
+        *size += read_size;
+        if (*size == capacity) {
+            capacity *= 2;
+            char *grown = realloc(*content, capacity);
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation failed\n");
+                free(*content);
+                return false;
+            }
+            *content = grown;
+        }
+    }
+
+    if (ferror(file)) {
+        fprintf(stderr, "Error: Failed to read entire file\n");
+        free(*content);
+        return false;
+    }
+    return true;
+}
+
+// Load FILENAME ('-' for stdin). Regular files are mapped read-only and
+// *MAPPED is set, anything else is read into a malloc'd buffer.
+// Release the result with release_file().
+bool read_file(const char *filename, char **content, size_t *size, bool *mapped) {
+    *mapped = false;
+
+    if (strcmp(filename, "-") == 0) {
+        return read_stream(stdin, content, size);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            *content = map;
+            *size = st.st_size;
+            *mapped = true;
+            return true;
+        }
+    }
+
+    FILE *file = fdopen(fd, "r");
+    if (!file) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
+        close(fd);
+        return false;
+    }
+
+    bool ok = read_stream(file, content, size);
+    fclose(file);
+    return ok;
+}
+
+void release_file(char *content, size_t size, bool mapped) {
+    if (mapped) {
+        munmap(content, size);
+    } else {
+        free(content);
+    }
+}
+
+// Statistics
+// --time-report and --stats. Phase times are summed over files, so
+// with -j they can add up to more than the wall clock.
+typedef enum {
+    PHASE_READ,
+    PHASE_LEX,
+    PHASE_PARSE,
+    PHASE_MERGE,
+    PHASE_CACHE,
+    PHASE_OPTIMIZE,
+    PHASE_CODEGEN,
+    PHASE_WRITE,
+    PHASE_NASM,
+    PHASE_LD,
+    NUM_PHASES
+} Phase;
+
+static const char *phase_names[NUM_PHASES] = {
+    [PHASE_READ]     = "read",
+    [PHASE_LEX]      = "lex",
+    [PHASE_PARSE]    = "parse",
+    [PHASE_MERGE]    = "merge",
+    [PHASE_CACHE]    = "cache",
+    [PHASE_OPTIMIZE] = "optimize",
+    [PHASE_CODEGEN]  = "codegen",
+    [PHASE_WRITE]    = "write",
+    [PHASE_NASM]     = "nasm",
+    [PHASE_LD]       = "ld",
+};
+
+typedef struct {
+    double seconds[NUM_PHASES];
+    bool ran[NUM_PHASES];
+    size_t files;
+    size_t source_bytes;
+    size_t tokens;
+    size_t procedures;
+    size_t reachable;
+    size_t parsed_calls;  // Call sites as written
+    size_t call_edges;    // Calls left once the optimizer is done
+    size_t bytes_emitted;
+    size_t cache_hits;    // --cache, builds written from the cache
+    size_t cache_misses;
+    Allocations history;  // TokenHistory
+    Allocations table;    // Procedures, their names and the symbol table
+    Allocations calls;    // Procedure.calls arrays
+    Allocations lines;    // Line indexes
+    Allocations arena;    // Everything the arenas handed out
+    Allocations chunks;   // What the arenas took to hand it out from
+} Stats;
+
+Stats stats = {0};
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+long peak_rss_kb(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// What is resident right now, from /proc/self/statm. -1 without it.
+long rss_kb(void) {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file) {
+        return -1;
+    }
+    long size, resident;
+    bool ok = fscanf(file, "%ld %ld", &size, &resident) == 2;
+    fclose(file);
+    return ok ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+void stats_phase(Phase phase, double start) {
+    stats.seconds[phase] += now_seconds() - start;
+    stats.ran[phase] = true;
+}
+
+static void stats_allocations(Allocations *total, Allocations *a) {
+    total->allocations += a->allocations;
+    total->bytes += a->bytes;
+}
+
+// Count the tokens and memory of C, once for every compiler used.
+void stats_add_compiler(Compiler* c) {
+    stats.tokens += c->history.count;
+    stats_allocations(&stats.history, &c->history.allocs);
+    stats_allocations(&stats.lines, &c->buffer.lines.allocs);
+    stats_allocations(&stats.table, &c->symbols.allocs);
+    stats_allocations(&stats.table, &c->procedures.allocs);
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        Procedure *proc = c->procedures.array[i];
+        stats.table.allocations += 2; // procedure_new, the procedure and its name
+        stats.table.bytes += sizeof(Procedure) + proc->length + 1;
+        stats_allocations(&stats.calls, &proc->calls_allocs);
+    }
+    stats.arena.allocations += c->arena.count;
+    stats.arena.bytes += c->arena.bytes;
+    stats_allocations(&stats.chunks, &c->arena.backing);
+}
+
+// Count the program C compiles to, after emit_program.
+void stats_add_program(Compiler* c) {
+    stats.procedures = c->procedures.num;
+    for (size_t i = 0; i < c->procedures.num; i++) {
+        stats.reachable += c->procedures.array[i]->reachable;
+        stats.parsed_calls += c->procedures.array[i]->num_calls;
+    }
+    stats.call_edges = c->graph.num_edges;
+    stats.bytes_emitted = c->output.size + c->code.size;
+}
+
+static void print_allocations(FILE *out, const char *name, Allocations *a) {
+    fprintf(out, "  %-14s %12zu %14zu\n", name, a->allocations, a->bytes);
+}
+
+void stats_print(FILE *out, bool times, bool counters) {
+    if (times) {
+        double total = 0;
+        for (int i = 0; i < NUM_PHASES; i++) {
+            total += stats.seconds[i];
+        }
+        fprintf(out, "Time report\n");
+        fprintf(out, "  %-14s %12s %7s\n", "phase", "seconds", "share");
+        for (int i = 0; i < NUM_PHASES; i++) {
+            if (stats.ran[i]) {
+                fprintf(out, "  %-14s %12.6f %6.1f%%\n", phase_names[i], stats.seconds[i],
+                        total > 0 ? 100 * stats.seconds[i] / total : 0);
+            }
+        }
+        fprintf(out, "  %-14s %12.6f\n", "total", total);
+    }
+    if (counters) {
+        fprintf(out, "Statistics\n");
+        fprintf(out, "  %-14s %12zu\n", "files", stats.files);
+        fprintf(out, "  %-14s %12zu\n", "source bytes", stats.source_bytes);
+        fprintf(out, "  %-14s %12zu\n", "tokens", stats.tokens);
+        fprintf(out, "  %-14s %12zu\n", "procedures", stats.procedures);
+        fprintf(out, "  %-14s %12zu\n", "reachable", stats.reachable);
+        fprintf(out, "  %-14s %12zu\n", "parsed calls", stats.parsed_calls);
+        fprintf(out, "  %-14s %12zu\n", "call edges", stats.call_edges);
+        fprintf(out, "  %-14s %12zu\n", "bytes emitted", stats.bytes_emitted);
+        fprintf(out, "  %-14s %12ld\n", "peak rss kb", peak_rss_kb());
+        fprintf(out, "  %-14s %12zu\n", "cache hits", stats.cache_hits);
+        fprintf(out, "  %-14s %12zu\n", "cache misses", stats.cache_misses);
+        fprintf(out, "  %-14s %12s %14s\n", "structure", "allocations", "bytes");
+        print_allocations(out, "token history", &stats.history);
+        print_allocations(out, "procedures", &stats.table);
+        print_allocations(out, "calls", &stats.calls);
+        print_allocations(out, "line index", &stats.lines);
+        print_allocations(out, "arena", &stats.arena);
+        print_allocations(out, "arena chunks", &stats.chunks);
+    }
+}
+
+static void json_allocations(FILE *out, const char *name, Allocations *a, bool last) {
+    fprintf(out, "\"%s\": {\"allocations\": %zu, \"bytes\": %zu}%s", name,
+            a->allocations, a->bytes, last ? "" : ", ");
+}
+
+// Everything stats_print shows, as one JSON object on a line of its own.
+bool stats_write_json(const char *path) {
+    FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Could not create output file '%s'\n", path);
+        return false;
+    }
+
+    fprintf(out, "{\"phases\": {");
+    bool first = true;
+    for (int i = 0; i < NUM_PHASES; i++) {
+        if (stats.ran[i]) {
+            fprintf(out, "%s\"%s\": %.9f", first ? "" : ", ", phase_names[i], stats.seconds[i]);
+            first = false;
+        }
+    }
+    fprintf(out, "}, \"files\": %zu, \"source_bytes\": %zu, \"tokens\": %zu, "
+                 "\"procedures\": %zu, \"reachable\": %zu, \"parsed_calls\": %zu, "
+                 "\"call_edges\": %zu, \"bytes_emitted\": %zu, \"peak_rss_kb\": %ld, "
+                 "\"cache_hits\": %zu, \"cache_misses\": %zu, \"allocations\": {",
+            stats.files, stats.source_bytes, stats.tokens, stats.procedures,
+            stats.reachable, stats.parsed_calls, stats.call_edges,
+            stats.bytes_emitted, peak_rss_kb(), stats.cache_hits, stats.cache_misses);
+    json_allocations(out, "token_history", &stats.history, false);
+    json_allocations(out, "procedures", &stats.table, false);
+    json_allocations(out, "calls", &stats.calls, false);
+    json_allocations(out, "line_index", &stats.lines, false);
+    json_allocations(out, "arena", &stats.arena, false);
+    json_allocations(out, "arena_chunks", &stats.chunks, true);
+    fprintf(out, "}}\n");
+
+    if (out != stdout) {
+        fclose(out);
+    }
+    return true;
+}
+
+// Multi-file compilation
+typedef struct {
+    const char *path;
+    char *source;
+    size_t size;
+    bool mapped;
+    Compiler *c;  // Local procedure table for this file
+    bool ok;
+    double seconds[NUM_PHASES]; // Read, lex and parse, added to stats
+} SourceUnit;
+
+typedef struct {
+    SourceUnit *units;
+    size_t num_units;
+    atomic_size_t next; // Next unit to hand out
+} ParseQueue;
+
+// Lex all of UNIT for parse to replay, timing it. False at a lex error.
+static bool lex_ahead(SourceUnit *unit) {
+    jmp_buf recover;
+    unit->c->recover = &recover;
+    if (setjmp(recover) != 0) {
+        return false;
+    }
+    double start = now_seconds();
+    do {
+        lex(unit->c);
+    } while (unit->c->current_token.type != TOKEN_EOF);
+    unit->seconds[PHASE_LEX] = now_seconds() - start;
+    unit->c->replay = 0;
+    unit->c->recover = NULL;
+    return true;
+}
+
+static void *parse_worker(void *arg) {
+    ParseQueue *queue = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&queue->next, 1)) < queue->num_units) {
+        SourceUnit *unit = &queue->units[i];
+        double start = now_seconds();
+        if (!unit->source) { // --cache reads them all first
+            if (!read_file(unit->path, &unit->source, &unit->size, &unit->mapped)) {
+                continue;
+            }
+            unit->seconds[PHASE_READ] = now_seconds() - start;
+        }
+        unit->c = compiler_new(unit->source, unit->size);
+        compiler_set_name(unit->c, unit->path);
+
+        // Lexing is interleaved with parsing, to time them apart the
+        // whole file is lexed first and parse replays the tokens
+        if (collect_stats && !lex_ahead(unit)) {
+            // The parser might fail before it reaches the bad
+            // character, start over untimed so the same error shows
+            compiler_free(unit->c);
+            unit->c = compiler_new(unit->source, unit->size);
+            compiler_set_name(unit->c, unit->path);
+        }
+        start = now_seconds();
+        parse(unit->c);
+        unit->c->replay = SIZE_MAX;
+        unit->seconds[PHASE_PARSE] = now_seconds() - start;
+        unit->ok = true;
+    }
+    return NULL;
+}
+
+// Fold the local tables into PROGRAM, in unit order so ids and output
+// are the same however the files were scheduled, and match compiling
+// the files concatenated. Calls are resolved by name against every file.
+static bool merge_units(Compiler *program, SourceUnit *units, size_t num_units) {
+    size_t most = 0;
+    for (size_t u = 0; u < num_units; u++) {
+        most += units[u].c->procedures.num;
+    }
+    program->reference_buffers = arena_alloc(&program->arena, most * sizeof(Buffer *));
+
+    bool ok = true;
+    for (size_t u = 0; u < num_units; u++) {
+        Procedures *local = &units[u].c->procedures;
+
+        // Names first, in the order the file mentions them. Diagnostics
+        // point at the first file that does.
+        for (size_t i = 0; i < local->num; i++) {
+            Procedure *global = intern_procedure_named(program, local->array[i]->name,
+                                                       local->array[i]->length);
+            if (global->reference.length == 0) {
+                global->reference = local->array[i]->reference;
+                program->reference_buffers[global->id] = &units[u].c->buffer;
+            }
+        }
+
+        for (size_t i = 0; i < local->num; i++) {
+            Procedure *proc = local->array[i];
+            if (!proc->defined) {
+                continue;
+            }
+            Procedure *global = find_procedure_named(program, proc->name, proc->length);
+            if (global->defined) {
+                fprintf(stderr, "%s: Error: Procedure '%s' is already defined\n",
+                        units[u].path, proc->name);
+                ok = false;
+                continue;
+            }
+            global->defined = true;
+            for (size_t j = 0; j < proc->num_calls; j++) {
+                Procedure *callee = proc->calls[j];
+                procedure_add_call(&program->arena, global,
+                                   intern_procedure_named(program, callee->name,
+                                                          callee->length));
+            }
+        }
+    }
+    return ok;
+}
+
+// Lex and parse every unit on up to JOBS threads. A single file is
+// parsed in place and its compiler returned as is, several are merged
+// into a fresh compiler. Sources stay owned by the units.
+Compiler *compile_units(SourceUnit *units, size_t num_units, size_t jobs) {
+    ParseQueue queue = {.units = units, .num_units = num_units};
+    atomic_init(&queue.next, 0);
+
+    if (jobs > num_units) {
+        jobs = num_units;
+    }
+    if (jobs <= 1) {
+        parse_worker(&queue);
+    } else {
+        pipeline_lexer = false; // The workers have the cores already
+        pthread_t *threads = malloc(jobs * sizeof(pthread_t));
+        for (size_t i = 0; i < jobs; i++) {
+            pthread_create(&threads[i], NULL, parse_worker, &queue);
+        }
+        for (size_t i = 0; i < jobs; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+    }
+
+    for (size_t i = 0; i < num_units; i++) {
+        if (collect_stats && units[i].ok) {
+            for (int p = PHASE_READ; p <= PHASE_PARSE; p++) {
+                stats.seconds[p] += units[i].seconds[p];
+                stats.ran[p] = stats.ran[p] || units[i].seconds[p] > 0;
+            }
+            stats.files++;
+            stats.source_bytes += units[i].size;
+            if (num_units > 1) {
+                stats_add_compiler(units[i].c); // The program is counted later
+            }
+        }
+    }
+    for (size_t i = 0; i < num_units; i++) {
+        if (!units[i].ok) {
+            return NULL;
+        }
+    }
+
+    if (num_units == 1) {
+        Compiler *c = units[0].c;
+        units[0].c = NULL;
+        return c;
+    }
+
+    double start = now_seconds();
+    Compiler *program = compiler_new("", 0);
+    bool ok = merge_units(program, units, num_units);
+    stats_phase(PHASE_MERGE, start);
+    if (!ok) {
+        compiler_free(program);
+        return NULL;
+    }
+    return program;
+}
+
+void release_units(SourceUnit *units, size_t num_units) {
+    for (size_t i = 0; i < num_units; i++) {
+        if (units[i].c) {
+            compiler_free(units[i].c);
+        }
+        if (units[i].source) {
+            release_file(units[i].source, units[i].size, units[i].mapped);
+        }
+    }
+    free(units);
+}
+
+// The key of a build with --cache: the sources, in order, and every
+// flag that changes the output. -j and the like don't.
+static uint64_t cache_key(SourceUnit *units, size_t num_units, bool assembly) {
+    uint64_t flags[] = {assembly, optimization_level, keep_frame_pointer,
+                        inline_threshold, inline_budget, num_units};
+    uint64_t key = hash64_bytes(FNV_OFFSET, flags, sizeof(flags));
+    for (size_t i = 0; i < num_units; i++) {
+        uint64_t size = units[i].size;
+        key = hash64_bytes(key, &size, sizeof(size));
+        key = hash64_words(key, units[i].source, units[i].size);
+    }
+    return key;
+}
+
+// Read every unit, then look the build up in CACHE. On a hit the last
+// build's output is written out the way emit_program would, and *HIT
+// set. False if a file couldn't be read or the output written.
+static bool emit_cached(Cache *cache, SourceUnit *units, size_t num_units,
+                        const char *asm_file_name, bool emit_asm, bool *hit) {
+    *hit = false;
+    for (size_t i = 0; i < num_units; i++) {
+        SourceUnit *unit = &units[i];
+        double start = now_seconds();
+        if (!read_file(unit->path, &unit->source, &unit->size, &unit->mapped)) {
+            return false;
+        }
+        stats_phase(PHASE_READ, start);
+    }
+    double start = now_seconds();
+    bool assembly = asm_file_name || emit_asm;
+    bool found = cache_load(cache, cache_path, cache_key(units, num_units, assembly));
+    stats_phase(PHASE_CACHE, start);
+    if (!found) {
+        return true;
+    }
+    *hit = true;
+    stats.files = num_units; // compile_units counts them otherwise
+    for (size_t i = 0; i < num_units; i++) {
+        stats.source_bytes += units[i].size;
+    }
+    stats.bytes_emitted = cache->output_size;
+
+    // A view of the cached output, never grown or freed
+    Emitter output = {.data = (char *)cache->output, .size = cache->output_size,
+                      .capacity = cache->output_size};
+    start = now_seconds();
+    bool ok;
+    if (asm_file_name) {
+        ok = emitter_write(&output, asm_file_name);
+        stats_phase(PHASE_WRITE, start);
+        return ok;
+    } else if (emit_asm) {
+        ok = emitter_write(&output, "output.asm");
+        stats_phase(PHASE_WRITE, start);
+        start = now_seconds();
+        ok = ok && system("nasm -f elf64 output.asm") == 0;
+        stats_phase(PHASE_NASM, start);
+        start = now_seconds();
+        ok = ok && system("ld -o a.out output.o") == 0;
+        stats_phase(PHASE_LD, start);
+    } else {
+        ok = emitter_write(&output, "a.out") && chmod("a.out", 0755) == 0;
+        stats_phase(PHASE_WRITE, start);
+    }
+
+    if (ok) {
+        printf("Compilation successful. Executable 'a.out' created.\n");
+    } else {
+        fprintf(stderr, "Error: Compilation failed\n");
+    }
+    return ok;
+}
+
+// Keep what C compiled to in CACHE: the assembly, or the executable
+// write_executable makes.
+static void cache_program(Cache *cache, Compiler *c, bool assembly) {
+    if (assembly) {
+        cache_save(cache, c->output.data, c->output.size);
+        return;
+    }
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr phdr;
+    elf_headers(&ehdr, &phdr, c->code.size, c->code_entry);
+    Emitter image;
+    emitter_init(&image);
+    emit_bytes(&image, (const char *)&ehdr, sizeof(ehdr));
+    emit_bytes(&image, (const char *)&phdr, sizeof(phdr));
+    emit_bytes(&image, c->code.data, c->code.size);
+    cache_save(cache, image.data, image.size);
+    emitter_free(&image);
+}
+
+// Generate code for C and write it out the way the command line asked,
+// keeping the output in CACHE if there is one.
+bool emit_program(Compiler *c, const char *asm_file_name, bool emit_asm, Cache *cache) {
+    double start = now_seconds();
+    bool optimized = optimize(c);
+    stats_phase(PHASE_OPTIMIZE, start);
+    if (!optimized) {
+        fprintf(stderr, "Error: Compilation failed\n");
+        return false;
+    }
+    if (stack_report) {
+        print_stack_report(c);
+    }
+
+    bool ok = true;
+    start = now_seconds();
+    if (asm_file_name || emit_asm) {
+        generate_code(c);
+    } else {
+        ok = generate_machine_code(c);
+    }
+    stats_phase(PHASE_CODEGEN, start);
+    if (ok && cache) {
+        start = now_seconds();
+        cache_program(cache, c, asm_file_name || emit_asm); // A stale cache only costs time
+        stats_phase(PHASE_CACHE, start);
+    }
+
+    start = now_seconds();
+    if (asm_file_name) {
+        ok = emitter_write(&c->output, asm_file_name);
+        stats_phase(PHASE_WRITE, start);
+        return ok;
+    } else if (emit_asm) {
+        ok = emitter_write(&c->output, "output.asm");
+        stats_phase(PHASE_WRITE, start);
+        start = now_seconds();
+        ok = ok && system("nasm -f elf64 output.asm") == 0;
+        stats_phase(PHASE_NASM, start);
+        start = now_seconds();
+        ok = ok && system("ld -o a.out output.o") == 0;
+        stats_phase(PHASE_LD, start);
+    } else {
+        ok = ok && write_executable(c, "a.out");
+        stats_phase(PHASE_WRITE, start);
+    }
+
+    if (ok) {
+        printf("Compilation successful. Executable 'a.out' created.\n");
+    } else {
+        fprintf(stderr, "Error: Compilation failed\n");
+    }
+    return ok;
+}
+
+// Language server
+// Just enough JSON for LSP messages. Strings are unescaped into the
+// arena, and every value remembers its raw text so ids can be echoed.
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} JsonType;
+
+typedef struct JsonValue {
+    JsonType type;
+    double number;           // JSON_NUMBER, and JSON_BOOL as 0 or 1
+    const char *string;      // JSON_STRING, NUL terminated
+    size_t length;
+    struct JsonValue *items; // JSON_ARRAY and JSON_OBJECT
+    const char **keys;       // JSON_OBJECT, one per item
+    size_t num_items;
+    const char *raw;         // The value as it appeared in the message
+    size_t raw_length;
+} JsonValue;
+
+typedef struct {
+    const char *p;
+    const char *end;
+    Arena *arena;
+    int depth;
+} JsonParser;
+
+#define JSON_MAX_DEPTH 64
+
+static void json_skip_space(JsonParser *json) {
+    while (json->p < json->end && CHAR_IS(*json->p, CHAR_SPACE)) {
+        json->p++;
+    }
+}
+
+static int json_hex(const char *p) {
+    int value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = isdigit((unsigned char)p[i]) ? p[i] - '0' :
+                    (p[i] | 0x20) >= 'a' && (p[i] | 0x20) <= 'f' ? (p[i] | 0x20) - 'a' + 10 : -1;
+        if (digit < 0) {
+            return -1;
+        }
+        value = value * 16 + digit;
+    }
+    return value;
+}
+
+static size_t utf8_encode(char *out, uint32_t cp) {
+    if (cp < 0x80) {
+        out[0] = cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = 0xc0 | (cp >> 6);
+        out[1] = 0x80 | (cp & 0x3f);
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = 0xe0 | (cp >> 12);
+        out[1] = 0x80 | ((cp >> 6) & 0x3f);
+        out[2] = 0x80 | (cp & 0x3f);
+        return 3;
+    }
+    out[0] = 0xf0 | (cp >> 18);
+    out[1] = 0x80 | ((cp >> 12) & 0x3f);
+    out[2] = 0x80 | ((cp >> 6) & 0x3f);
+    out[3] = 0x80 | (cp & 0x3f);
+    return 4;
+}
+
+// Expects json->p on the opening quote. Decoding never makes a string
+// longer, so the raw length bounds the copy.
+static bool json_parse_string(JsonParser *json, const char **string, size_t *length) {
+    const char *start = ++json->p;
+    while (json->p < json->end && *json->p != '"') {
+        json->p += *json->p == '\\' ? 2 : 1;
+    }
+    if (json->p >= json->end) {
+        return false;
+    }
+
+    char *out = arena_alloc(json->arena, json->p - start + 1);
+    size_t n = 0;
+    for (const char *s = start; s < json->p; s++) {
+        if (*s != '\\') {
+            out[n++] = *s;
+            continue;
+        }
+        switch (*++s) {
+        case 'b': out[n++] = '\b'; break;
+        case 'f': out[n++] = '\f'; break;
+        case 'n': out[n++] = '\n'; break;
+        case 'r': out[n++] = '\r'; break;
+        case 't': out[n++] = '\t'; break;
+        case 'u': {
+            int cp = json->p - s > 4 ? json_hex(s + 1) : -1;
+            if (cp < 0) {
+                return false;
+            }
+            s += 4;
+            // A surrogate pair spells one code point outside the BMP
+            if (cp >= 0xd800 && cp < 0xdc00 && json->p - s > 6 &&
+                s[1] == '\\' && s[2] == 'u') {
+                int low = json_hex(s + 3);
+                if (low >= 0xdc00 && low < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+                    s += 6;
+                }
+            }
+            n += utf8_encode(out + n, cp);
+            break;
+        }
+        default: out[n++] = *s; break; // '"', '\\' and '/'
+        }
+    }
+    out[n] = '\0';
+    json->p++; // Closing quote
+    *string = out;
+    *length = n;
+    return true;
+}
+
+static bool json_parse_value(JsonParser *json, JsonValue *value);
+
+// Parse the items of an array or object up to CLOSE, into the arena.
+static bool json_parse_items(JsonParser *json, JsonValue *value, char close) {
+    size_t capacity = 0;
+    json->p++; // Opening bracket
+    json_skip_space(json);
+    if (json->p < json->end && *json->p == close) {
+        json->p++;
+        return true;
+    }
+
+    while (json->p < json->end) {
+        if (value->num_items >= capacity) {
+            size_t old_capacity = capacity;
+            capacity = capacity == 0 ? 4 : capacity * 2;
+            value->items = arena_grow(json->arena, value->items,
+                                      old_capacity * sizeof(JsonValue),
+                                      capacity * sizeof(JsonValue));
+            if (close == '}') {
+                value->keys = arena_grow(json->arena, value->keys,
+                                         old_capacity * sizeof(char *),
+                                         capacity * sizeof(char *));
+            }
+        }
+
+        if (close == '}') {
+            size_t key_length;
+            json_skip_space(json);
+            if (json->p >= json->end || *json->p != '"' ||
+                !json_parse_string(json, &value->keys[value->num_items], &key_length)) {
+                return false;
+            }
+            json_skip_space(json);
+            if (json->p >= json->end || *json->p++ != ':') {
+                return false;
+            }
+        }
+        if (!json_parse_value(json, &value->items[value->num_items++])) {
+            return false;
+        }
+
+        json_skip_space(json);
+        if (json->p >= json->end) {
+            return false;
+        }
+        char ch = *json->p++;
+        if (ch == close) {
+            return true;
+        } else if (ch != ',') {
+            return false;
+        }
+    }
+    return false;
+}
+
+static bool json_parse_value(JsonParser *json, JsonValue *value) {
+    memset(value, 0, sizeof(JsonValue));
+    json_skip_space(json);
+    if (json->p >= json->end || ++json->depth > JSON_MAX_DEPTH) {
+        return false;
+    }
+
+    value->raw = json->p;
+    bool ok = true;
+    char ch = *json->p;
+    if (ch == '"') {
+        value->type = JSON_STRING;
+        ok = json_parse_string(json, &value->string, &value->length);
+    } else if (ch == '{' || ch == '[') {
+        value->type = ch == '{' ? JSON_OBJECT : JSON_ARRAY;
+        ok = json_parse_items(json, value, ch == '{' ? '}' : ']');
+    } else if (json->end - json->p >= 4 && memcmp(json->p, "true", 4) == 0) {
+        value->type = JSON_BOOL;
+        value->number = 1;
+        json->p += 4;
+    } else if (json->end - json->p >= 5 && memcmp(json->p, "false", 5) == 0) {
+        value->type = JSON_BOOL;
+        json->p += 5;
+    } else if (json->end - json->p >= 4 && memcmp(json->p, "null", 4) == 0) {
+        json->p += 4;
+    } else {
+        // The message buffer is NUL terminated, so strtod stops in it
+        char *end;
+        value->type = JSON_NUMBER;
+        value->number = strtod(json->p, &end);
+        ok = end != json->p;
+        json->p = end;
+    }
+    value->raw_length = json->p - value->raw;
+    json->depth--;
+    return ok;
+}
+
+// Member KEY of OBJECT, NULL when either is missing.
+static JsonValue *json_get(JsonValue *object, const char *key) {
+    if (!object || object->type != JSON_OBJECT) {
+        return NULL;
+    }
+    for (size_t i = 0; i < object->num_items; i++) {
+        if (strcmp(object->keys[i], key) == 0) {
+            return &object->items[i];
+        }
+    }
+    return NULL;
+}
+
+static void emit_json_string(Emitter *e, const char *s, size_t length) {
+    emit_char(e, '"');
+    for (size_t i = 0; i < length; i++) {
+        unsigned char ch = s[i];
+        if (ch == '"' || ch == '\\') {
+            emit_char(e, '\\');
+            emit_char(e, ch);
+        } else if (ch == '\n') {
+            emit_literal(e, "\\n");
+        } else if (ch < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", ch);
+            emit_bytes(e, escape, 6);
+        } else {
+            emit_char(e, ch);
+        }
+    }
+    emit_char(e, '"');
+}
+
+static void emit_json_size(Emitter *e, size_t n) {
+    char digits[32];
+    emit_bytes(e, digits, snprintf(digits, sizeof(digits), "%zu", n));
+}
+
+// Messages are a Content-Length header, a blank line and the body.
+// Returns the NUL terminated body, or NULL once input ends.
+static char *lsp_read_message(FILE *in, size_t *length) {
+    char line[256];
+    size_t content_length = 0;
+    bool has_length = false;
+    while (fgets(line, sizeof(line), in)) {
+        if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+            if (!has_length) {
+                continue;
+            }
+            char *body = malloc(content_length + 1);
+            if (fread(body, 1, content_length, in) != content_length) {
+                free(body);
+                return NULL;
+            }
+            body[content_length] = '\0';
+            *length = content_length;
+            return body;
+        }
+        if (strncmp(line, "Content-Length:", 15) == 0) {
+            content_length = strtoul(line + 15, NULL, 10);
+            has_length = true;
+        }
+    }
+    return NULL;
+}
+
+static void lsp_send(Emitter *body) {
+    Emitter message;
+    emitter_init(&message);
+    emit_literal(&message, "Content-Length: ");
+    emit_json_size(&message, body->size);
+    emit_literal(&message, "\r\n\r\n");
+    emit_bytes(&message, body->data, body->size);
+    emitter_write(&message, "-");
+    emitter_free(&message);
+}
 
-void keyCallback(int key, int action, int mods) {
-    bool shiftPressed = mods & GLFW_MOD_SHIFT;
-    bool ctrlPressed = mods & GLFW_MOD_CONTROL;
-    bool altPressed = mods & GLFW_MOD_ALT;
-    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
-        switch (key) {
-        case KEY_J:
-        case KEY_N:
-        case KEY_SPACE:
-        case KEY_F:
-            should_step = true;
+// An open file. Its compiler owns the text, edits go into its buffer
+// and are parsed incrementally, and it stays around to answer queries.
+typedef struct {
+    char *uri;
+    Compiler *c;
+    bool parsed;  // False when parsing stopped at c->error_message
+} Document;
+
+typedef struct {
+    Document *docs;
+    size_t num_docs;
+    size_t capacity;
+    bool shutdown;
+} Server;
+
+static Document *server_find(Server *server, const char *uri) {
+    for (size_t i = 0; i < server->num_docs; i++) {
+        if (strcmp(server->docs[i].uri, uri) == 0) {
+            return &server->docs[i];
+        }
+    }
+    return NULL;
+}
+
+// Replace the document's text and parse it from scratch, catching the
+// first error. TEXT may belong to the compiler being replaced.
+static void document_update(Document *doc, const char *text, size_t size) {
+    Compiler *old = doc->c;
+    doc->c = compiler_new(text, size);
+    buffer_reserve(&doc->c->buffer, 0); // Take a copy to edit
+    if (old) {
+        compiler_free(old);
+    }
+
+    compiler_set_name(doc->c, doc->uri);
+    jmp_buf recover;
+    doc->c->recover = &recover;
+    doc->parsed = false;
+    if (setjmp(recover) == 0) {
+        parse(doc->c);
+        doc->parsed = true;
+    }
+    doc->c->recover = NULL;
+}
+
+static void document_free(Document *doc) {
+    if (doc->c) {
+        compiler_free(doc->c);
+    }
+    free(doc->uri);
+}
+
+// LSP positions are zero based lines and columns, clamped to the line.
+static size_t lsp_point(Buffer *buffer, JsonValue *position) {
+    JsonValue *line = json_get(position, "line");
+    JsonValue *character = json_get(position, "character");
+    if (!line || !character || line->number < 0 || character->number < 0) {
+        return 0;
+    }
+    size_t row = line->number;
+    if (row >= buffer->lines.count) {
+        return buffer->size;
+    }
+    size_t start = buffer->lines.starts[row];
+    size_t end = row + 1 < buffer->lines.count ? buffer->lines.starts[row + 1] - 1
+                                                : buffer->size;
+    size_t point = start + (size_t)character->number;
+    return point < end ? point : end;
+}
+
+static void emit_lsp_position(Emitter *e, Buffer *buffer, size_t point) {
+    Position pos = buffer_position(buffer, point);
+    emit_literal(e, "{\"line\":");
+    emit_json_size(e, pos.line);
+    emit_literal(e, ",\"character\":");
+    emit_json_size(e, pos.col - 1);
+    emit_char(e, '}');
+}
+
+static void emit_lsp_range(Emitter *e, Buffer *buffer, Span span) {
+    emit_literal(e, "{\"start\":");
+    emit_lsp_position(e, buffer, span.start);
+    emit_literal(e, ",\"end\":");
+    emit_lsp_position(e, buffer, span.start + span.length);
+    emit_char(e, '}');
+}
+
+static void emit_lsp_diagnostic(Emitter *e, bool *first, Buffer *buffer,
+                                Span span, const char *message, size_t length) {
+    if (!*first) {
+        emit_char(e, ',');
+    }
+    *first = false;
+    emit_literal(e, "{\"range\":");
+    emit_lsp_range(e, buffer, span);
+    emit_literal(e, ",\"severity\":1,\"source\":\"imp\",\"message\":");
+    emit_json_string(e, message, length);
+    emit_char(e, '}');
+}
+
+// Where to report PROC. Its reference is dropped when the text holding
+// it is re-parsed, then any other mention will do.
+static Span procedure_mention(Compiler* c, Procedure *proc) {
+    if (proc->reference.length == 0) {
+        for (size_t i = 0; i < c->history.count; i++) {
+            Token *token = &c->history.tokens[i];
+            if (token->type == TOKEN_IDENTIFIER && token->lexeme.length == proc->length &&
+                memcmp(span_text(&c->buffer, token->lexeme), proc->name, proc->length) == 0) {
+                proc->reference = token->lexeme;
+                break;
+            }
+        }
+    }
+    return proc->reference;
+}
+
+// The parse error if there is one, otherwise a diagnostic at a mention
+// of every procedure that is called but never defined.
+static void server_publish_diagnostics(Document *doc, bool closed) {
+    Emitter e;
+    emitter_init(&e);
+    emit_literal(&e, "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\","
+                     "\"params\":{\"uri\":");
+    emit_json_string(&e, doc->uri, strlen(doc->uri));
+    emit_literal(&e, ",\"diagnostics\":[");
+
+    bool first = true;
+    Compiler *c = doc->c;
+    if (closed) {
+        // Clear whatever the client still shows
+    } else if (!doc->parsed) {
+        Span at = {.start = c->error_point, .length = 0};
+        emit_lsp_diagnostic(&e, &first, &c->buffer, at, c->error_message,
+                            strlen(c->error_message));
+    } else {
+        for (size_t i = 0; i < c->procedures.num; i++) {
+            Procedure *proc = c->procedures.array[i];
+            if (proc->defined || proc->num_references == 0) {
+                continue;
+            }
+            char message[256];
+            int length = snprintf(message, sizeof(message),
+                                  "Procedure '%s' is called but never defined", proc->name);
+            emit_lsp_diagnostic(&e, &first, &c->buffer, procedure_mention(c, proc), message,
+                                length < (int)sizeof(message) ? (size_t)length
+                                                              : sizeof(message) - 1);
+        }
+    }
+
+    emit_literal(&e, "]}}");
+    lsp_send(&e);
+    emitter_free(&e);
+}
+
+// The identifier token touching POINT, found by binary search over the
+// token history. A point right after a name still counts, that is where
+// editors leave the cursor after typing it.
+Token *symbol_at(Compiler* c, size_t point) {
+    TokenHistory *history = &c->history;
+    size_t lo = 0, hi = history->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (history->tokens[mid].lexeme.start <= point) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    // Tokens lo - 1 and lo - 2 are the last to start at or before POINT
+    for (size_t k = lo; k > 0 && k + 2 > lo; k--) {
+        Token *token = &history->tokens[k - 1];
+        Span span = token->lexeme;
+        if (token->type == TOKEN_IDENTIFIER && point <= span.start + span.length) {
+            return token;
+        }
+        if (span.start < point) {
             break;
-          break;
-        case KEY_MINUS:
-            previousTheme();
-          break;
-        case KEY_H:
-            single_highlight_mode = !single_highlight_mode;
-          break;
-        case KEY_EQUAL:
-            nextTheme();
-          break;
         }
     }
+    return NULL;
 }
 
-bool read_file(const char *filename, char **content, size_t *size) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
-        return false;
+static void lsp_begin_response(Emitter *e, JsonValue *id) {
+    emit_literal(e, "{\"jsonrpc\":\"2.0\",\"id\":");
+    emit_bytes(e, id->raw, id->raw_length);
+}
+
+// Where the procedure named at the requested position is defined.
+static void server_definition(Server *server, JsonValue *params, Emitter *e) {
+    JsonValue *uri = json_get(json_get(params, "textDocument"), "uri");
+    Document *doc = uri && uri->type == JSON_STRING ? server_find(server, uri->string) : NULL;
+    if (!doc) {
+        emit_literal(e, "null");
+        return;
     }
 
-    fseek(file, 0, SEEK_END);
-    *size = ftell(file);
-    rewind(file);
+    Compiler *c = doc->c;
+    Token *token = symbol_at(c, lsp_point(&c->buffer, json_get(params, "position")));
+    Procedure *proc = token ? find_procedure(c, token->lexeme) : NULL;
+    if (!proc || !proc->defined) {
+        emit_literal(e, "null");
+        return;
+    }
+    emit_literal(e, "{\"uri\":");
+    emit_json_string(e, doc->uri, strlen(doc->uri));
+    emit_literal(e, ",\"range\":");
+    emit_lsp_range(e, &c->buffer, proc->definition);
+    emit_char(e, '}');
+}
 
-    *content = malloc(*size + 1);
-    if (!*content) {
-        fprintf(stderr, "Error: Memory allocation failed\n");
-        fclose(file);
-        return false;
+// imp/returnSymbolAt, the server side of --return-symbol-at. Takes a
+// byte offset as "point", or an LSP "position".
+static void server_symbol_at(Server *server, JsonValue *params, Emitter *e) {
+    JsonValue *uri = json_get(json_get(params, "textDocument"), "uri");
+    Document *doc = uri && uri->type == JSON_STRING ? server_find(server, uri->string) : NULL;
+    if (!doc) {
+        emit_literal(e, "null");
+        return;
     }
 
-    size_t read_size = fread(*content, 1, *size, file);
-    if (read_size != *size) {
-        fprintf(stderr, "Error: Failed to read entire file\n");
-        free(*content);
-        fclose(file);
+    Compiler *c = doc->c;
+    JsonValue *point = json_get(params, "point");
+    size_t at = point && point->number >= 0 ? (size_t)point->number
+                                            : lsp_point(&c->buffer, json_get(params, "position"));
+    Token *token = symbol_at(c, at);
+    if (!token) {
+        emit_literal(e, "null");
+        return;
+    }
+    Procedure *proc = find_procedure(c, token->lexeme);
+    emit_literal(e, "{\"name\":");
+    emit_json_string(e, span_text(&c->buffer, token->lexeme), token->lexeme.length);
+    emit_literal(e, ",\"range\":");
+    emit_lsp_range(e, &c->buffer, token->lexeme);
+    emit_literal(e, ",\"defined\":");
+    if (proc && proc->defined) {
+        emit_literal(e, "true}");
+    } else {
+        emit_literal(e, "false}");
+    }
+}
+
+static void server_open(Server *server, JsonValue *params) {
+    JsonValue *document = json_get(params, "textDocument");
+    JsonValue *uri = json_get(document, "uri");
+    JsonValue *text = json_get(document, "text");
+    if (!uri || uri->type != JSON_STRING || !text || text->type != JSON_STRING) {
+        return;
+    }
+
+    Document *doc = server_find(server, uri->string);
+    if (!doc) {
+        if (server->num_docs >= server->capacity) {
+            server->capacity = server->capacity == 0 ? 4 : server->capacity * 2;
+            server->docs = realloc(server->docs, server->capacity * sizeof(Document));
+        }
+        doc = &server->docs[server->num_docs++];
+        doc->uri = strdup(uri->string);
+        doc->c = NULL;
+    }
+    document_update(doc, text->string, text->length);
+    server_publish_diagnostics(doc, false);
+}
+
+// Changes with a range are applied to the buffer in order and then
+// re-lexed and re-parsed as one edit, one without replaces everything.
+static void server_change(Server *server, JsonValue *params) {
+    JsonValue *uri = json_get(json_get(params, "textDocument"), "uri");
+    JsonValue *changes = json_get(params, "contentChanges");
+    Document *doc = uri && uri->type == JSON_STRING ? server_find(server, uri->string) : NULL;
+    if (!doc || !changes || changes->type != JSON_ARRAY) {
+        return;
+    }
+
+    Edit edit;
+    bool pending = false;
+    for (size_t i = 0; i < changes->num_items; i++) {
+        JsonValue *text = json_get(&changes->items[i], "text");
+        JsonValue *range = json_get(&changes->items[i], "range");
+        if (!text || text->type != JSON_STRING) {
+            continue;
+        }
+        if (!range) {
+            document_update(doc, text->string, text->length);
+            pending = false;
+            continue;
+        }
+
+        Buffer *buffer = &doc->c->buffer;
+        size_t start = lsp_point(buffer, json_get(range, "start"));
+        size_t end = lsp_point(buffer, json_get(range, "end"));
+        if (end < start) {
+            end = start;
+        }
+        buffer_replace(buffer, start, end, text->string, text->length);
+        edit_merge(&edit, &pending, start, end, text->length);
+    }
+
+    // Text that never parsed has nothing to update incrementally
+    if (pending && !(doc->parsed && compiler_update(doc->c, edit))) {
+        buffer_close_gap(&doc->c->buffer);
+        document_update(doc, doc->c->buffer.content, doc->c->buffer.size);
+    }
+    server_publish_diagnostics(doc, false);
+}
+
+static void server_close(Server *server, JsonValue *params) {
+    JsonValue *uri = json_get(json_get(params, "textDocument"), "uri");
+    Document *doc = uri && uri->type == JSON_STRING ? server_find(server, uri->string) : NULL;
+    if (!doc) {
+        return;
+    }
+    server_publish_diagnostics(doc, true);
+    document_free(doc);
+    *doc = server->docs[--server->num_docs];
+}
+
+// Answer one message. Requests get a response, notifications don't.
+static void server_handle(Server *server, JsonValue *message) {
+    JsonValue *method = json_get(message, "method");
+    JsonValue *id = json_get(message, "id");
+    JsonValue *params = json_get(message, "params");
+    if (!method || method->type != JSON_STRING) {
+        return; // A response to something we never ask
+    }
+    const char *name = method->string;
+
+    if (!id) {
+        if (strcmp(name, "textDocument/didOpen") == 0) {
+            server_open(server, params);
+        } else if (strcmp(name, "textDocument/didChange") == 0) {
+            server_change(server, params);
+        } else if (strcmp(name, "textDocument/didClose") == 0) {
+            server_close(server, params);
+        }
+        return;
+    }
+
+    Emitter e;
+    emitter_init(&e);
+    lsp_begin_response(&e, id);
+    if (strcmp(name, "initialize") == 0) {
+        emit_literal(&e, ",\"result\":{\"capabilities\":{\"textDocumentSync\":2,"
+                         "\"definitionProvider\":true},"
+                         "\"serverInfo\":{\"name\":\"imp\"}}}");
+    } else if (strcmp(name, "shutdown") == 0) {
+        server->shutdown = true;
+        emit_literal(&e, ",\"result\":null}");
+    } else if (strcmp(name, "textDocument/definition") == 0) {
+        emit_literal(&e, ",\"result\":");
+        server_definition(server, params, &e);
+        emit_char(&e, '}');
+    } else if (strcmp(name, "imp/returnSymbolAt") == 0) {
+        emit_literal(&e, ",\"result\":");
+        server_symbol_at(server, params, &e);
+        emit_char(&e, '}');
+    } else {
+        emit_literal(&e, ",\"error\":{\"code\":-32601,\"message\":\"Unknown method\"}}");
+    }
+    lsp_send(&e);
+    emitter_free(&e);
+}
+
+// --lsp, serve stdin and stdout until the client says exit. Documents
+// stay parsed in between messages, so queries never touch the disk.
+int run_language_server(void) {
+    arena_recycle = true; // Every change throws a compiler away
+    Server server = {0};
+    int status = 1; // Input ending without an exit
+    size_t length;
+    char *body;
+
+    while ((body = lsp_read_message(stdin, &length))) {
+        Arena arena;
+        arena_init(&arena);
+        JsonParser json = {.p = body, .end = body + length, .arena = &arena, .depth = 0};
+        JsonValue message;
+        bool exiting = false;
+        if (json_parse_value(&json, &message)) {
+            JsonValue *method = json_get(&message, "method");
+            exiting = method && method->type == JSON_STRING &&
+                      strcmp(method->string, "exit") == 0;
+            if (!exiting) {
+                server_handle(&server, &message);
+            }
+        } else {
+            fprintf(stderr, "imp: Ignoring malformed message\n");
+        }
+        arena_free(&arena);
+        free(body);
+        if (exiting) {
+            status = server.shutdown ? 0 : 1;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < server.num_docs; i++) {
+        document_free(&server.docs[i]);
+    }
+    free(server.docs);
+    return status;
+}
+
+// --return-symbol-at POINT, print the name of the procedure touching
+// byte offset POINT of PATH.
+int return_symbol_at(const char *path, size_t point) {
+    char *source;
+    size_t size;
+    bool mapped;
+    if (!read_file(path, &source, &size, &mapped)) {
+        return 1;
+    }
+
+    Compiler *c = compiler_new(source, size);
+    compiler_set_name(c, path);
+    parse(c);
+    Token *token = symbol_at(c, point);
+    if (token) {
+        printf("%.*s\n", (int)token->lexeme.length, span_text(&c->buffer, token->lexeme));
+    }
+
+    compiler_free(c);
+    release_file(source, size, mapped);
+    return token ? 0 : 1;
+}
+
+// Dumps
+// --dump-tokens and --dump-graph write what the front end built, as
+// JSON lines or as a binary file meant to be mapped and read in place.
+// Binary dumps are a DumpHeader followed by 8 byte aligned sections,
+// every field little endian like the code we generate. Readers check
+// the magic and version, and size records from the header so fields
+// can be added at the end of a record without breaking them.
+#define DUMP_VERSION 1
+
+typedef struct {
+    char magic[4];        // "IMPT" for tokens, "IMPG" for the graph
+    uint32_t version;     // DUMP_VERSION
+    uint32_t record_size; // Bytes per DumpToken or DumpProcedure
+    uint32_t reserved;
+    uint64_t count;       // Tokens, or procedures
+    uint64_t size;        // Source bytes, or edges
+} DumpHeader;
+
+// Tokens follow the header in source order, the last is TOKEN_EOF.
+typedef struct {
+    uint64_t start;  // Byte offset into the source
+    uint32_t length;
+    uint32_t row;    // 1-based
+    uint32_t col;    // 1-based, in bytes
+    uint8_t type;    // TokenType
+    uint8_t padding[3];
+} DumpToken;
+
+#define DUMP_DEFINED 1 // Has a body, rather than only being called
+
+// The graph is count DumpProcedures in id order, then the CallGraph
+// offsets (count + 1 uint32_t) and edges (size uint32_t), then the
+// names, each NUL terminated.
+typedef struct {
+    uint32_t name;   // Offset into the names
+    uint32_t length; // Name bytes, not counting the NUL
+    uint32_t flags;  // DUMP_DEFINED
+    uint32_t reserved;
+} DumpProcedure;
+
+static const char *token_type_names[] = {
+    [TOKEN_IDENTIFIER]   = "identifier",
+    [TOKEN_DOUBLE_COLON] = "double_colon",
+    [TOKEN_PROC]         = "proc",
+    [TOKEN_LPAREN]       = "lparen",
+    [TOKEN_RPAREN]       = "rparen",
+    [TOKEN_LBRACE]       = "lbrace",
+    [TOKEN_RBRACE]       = "rbrace",
+    [TOKEN_EOF]          = "eof",
+};
+
+static void emit_dump_header(Emitter *e, const char *magic, uint32_t record_size,
+                             uint64_t count, uint64_t size) {
+    DumpHeader header = {
+        .version = DUMP_VERSION,
+        .record_size = record_size,
+        .count = count,
+        .size = size,
+    };
+    memcpy(header.magic, magic, sizeof(header.magic));
+    emit_bytes(e, (const char *)&header, sizeof(header));
+}
+
+static void emit_dump_align(Emitter *e) {
+    while (e->size % 8) {
+        emit_char(e, 0);
+    }
+}
+
+// The history is in source order, so positions come from walking the
+// line index alongside it rather than a search per token.
+bool dump_tokens(Compiler *c, const char *path, bool jsonl) {
+    TokenHistory *history = &c->history;
+    LineIndex *lines = &c->buffer.lines;
+    Emitter out;
+    emitter_init(&out);
+    if (!jsonl) {
+        emit_dump_header(&out, "IMPT", sizeof(DumpToken), history->count,
+                         c->buffer.size);
+    }
+
+    size_t line = 0;
+    for (size_t i = 0; i < history->count; i++) {
+        Token *token = &history->tokens[i];
+        while (line + 1 < lines->count &&
+               lines->starts[line + 1] <= token->lexeme.start) {
+            line++;
+        }
+        size_t col = token->lexeme.start - lines->starts[line] + 1;
+
+        if (jsonl) {
+            emit_literal(&out, "{\"type\":\"");
+            emit_bytes(&out, token_type_names[token->type],
+                       strlen(token_type_names[token->type]));
+            emit_literal(&out, "\",\"start\":");
+            emit_json_size(&out, token->lexeme.start);
+            emit_literal(&out, ",\"length\":");
+            emit_json_size(&out, token->lexeme.length);
+            emit_literal(&out, ",\"row\":");
+            emit_json_size(&out, line + 1);
+            emit_literal(&out, ",\"col\":");
+            emit_json_size(&out, col);
+            emit_literal(&out, "}\n");
+        } else {
+            DumpToken record = {
+                .start = token->lexeme.start,
+                .length = token->lexeme.length,
+                .row = line + 1,
+                .col = col,
+                .type = token->type,
+            };
+            emit_bytes(&out, (const char *)&record, sizeof(record));
+        }
+    }
+
+    bool ok = emitter_write(&out, path);
+    emitter_free(&out);
+    return ok;
+}
+
+// The graph as parsed, before the optimizer prunes or inlines anything.
+bool dump_graph(Compiler *c, const char *path, bool jsonl) {
+    Procedures *procedures = &c->procedures;
+    CallGraph graph;
+    call_graph_build(&c->arena, &graph, procedures);
+    Emitter out;
+    emitter_init(&out);
+
+    if (jsonl) {
+        for (size_t i = 0; i < procedures->num; i++) {
+            Procedure *proc = procedures->array[i];
+            emit_literal(&out, "{\"id\":");
+            emit_json_size(&out, i);
+            emit_literal(&out, ",\"name\":");
+            emit_json_string(&out, proc->name, proc->length);
+            if (proc->defined) {
+                emit_literal(&out, ",\"defined\":true,\"calls\":[");
+            } else {
+                emit_literal(&out, ",\"defined\":false,\"calls\":[");
+            }
+            uint32_t *calls = call_graph_calls(&graph, i);
+            for (size_t j = 0; j < proc->num_calls; j++) {
+                if (j > 0) {
+                    emit_char(&out, ',');
+                }
+                emit_json_size(&out, calls[j]);
+            }
+            emit_literal(&out, "]}\n");
+        }
+    } else {
+        emit_dump_header(&out, "IMPG", sizeof(DumpProcedure), procedures->num,
+                         graph.num_edges);
+        size_t name = 0;
+        for (size_t i = 0; i < procedures->num; i++) {
+            Procedure *proc = procedures->array[i];
+            DumpProcedure record = {
+                .name = name,
+                .length = proc->length,
+                .flags = proc->defined ? DUMP_DEFINED : 0,
+            };
+            emit_bytes(&out, (const char *)&record, sizeof(record));
+            name += proc->length + 1;
+        }
+        emit_bytes(&out, (const char *)graph.offsets,
+                   (graph.num_nodes + 1) * sizeof(uint32_t));
+        emit_dump_align(&out);
+        emit_bytes(&out, (const char *)graph.edges,
+                   graph.num_edges * sizeof(uint32_t));
+        emit_dump_align(&out);
+        for (size_t i = 0; i < procedures->num; i++) {
+            emit_bytes(&out, procedures->array[i]->name,
+                       procedures->array[i]->length + 1);
+        }
+    }
+
+    bool ok = emitter_write(&out, path);
+    emitter_free(&out);
+    return ok;
+}
+
+// Fill C's history from a --dump-tokens file of the same source, for
+// the stepper to replay. lex() hands the tokens out in turn and scans
+// on from the last one if the dump stops short of EOF. A dump that
+// doesn't match the source is ignored, the file is lexed as usual.
+bool load_tokens(Compiler *c, const char *path) {
+    char *file;
+    size_t size;
+    bool mapped;
+    if (!read_file(path, &file, &size, &mapped)) {
         return false;
     }
 
-    (*content)[*size] = '\0';
-    fclose(file);
+    DumpHeader header;
+    bool ok = size >= sizeof(header);
+    if (ok) {
+        memcpy(&header, file, sizeof(header));
+        ok = memcmp(header.magic, "IMPT", 4) == 0 && header.version == DUMP_VERSION &&
+             header.record_size >= sizeof(DumpToken) && header.size == c->buffer.size &&
+             header.count <= (size - sizeof(header)) / header.record_size;
+    }
+
+    size_t end = 0;
+    for (size_t i = 0; ok && i < header.count; i++) {
+        DumpToken record;
+        memcpy(&record, file + sizeof(header) + i * header.record_size, sizeof(record));
+        // In order and inside the source, seekPoint searches the history
+        ok = record.type <= TOKEN_EOF && record.start >= end &&
+             record.start + record.length <= c->buffer.size;
+        if (ok) {
+            token_history_add(&c->history, token_new(record.type, record.start,
+                                                     record.start + record.length));
+            end = record.start + record.length;
+        }
+    }
+
+    if (ok) {
+        c->loaded = c->history.count;
+        c->history.count = 0;
+    } else {
+        fprintf(stderr, "Warning: '%s' is not a token dump of '%s', lexing instead\n",
+                path, c->buffer.name);
+        c->history.count = 0;
+    }
+    release_file(file, size, mapped);
+    return ok;
+}
+
+// Benchmark
+typedef struct {
+    const char *name;
+    double best;       // Fastest iteration, in seconds
+    double total;      // Sum over all iterations
+    size_t tokens;
+    size_t procedures;
+    size_t bytes;      // Input bytes for read/lex/parse, output for codegen
+    long rss_delta_kb; // Resident set growth over the phase, last iteration
+} BenchPhase;
+
+enum {
+    BENCH_READ,
+    BENCH_LEX,
+    BENCH_PARSE,
+    BENCH_OPTIMIZE,
+    BENCH_ASM,
+    BENCH_CODE,
+    BENCH_PHASES
+};
+
+// Touch a byte of every page of DATA, so whoever reads it first
+// doesn't pay for mapping it in.
+static void fault_in(const char *data, size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    volatile char sink = 0;
+    for (size_t i = 0; i < size; i += page) {
+        sink ^= data[i];
+    }
+    (void)sink;
+}
+
+// RSS is what rss_kb said just before the phase started.
+static void bench_record(BenchPhase *phase, double start, long rss, size_t tokens,
+                         size_t procedures, size_t bytes) {
+    double elapsed = now_seconds() - start;
+    if (phase->total == 0 || elapsed < phase->best) {
+        phase->best = elapsed;
+    }
+    phase->total += elapsed;
+    phase->tokens = tokens;
+    phase->procedures = procedures;
+    phase->bytes = bytes;
+    long now = rss_kb();
+    phase->rss_delta_kb = rss >= 0 && now >= 0 ? now - rss : 0;
+}
+
+// Run the whole headless pipeline on PATH ITERATIONS times, timing each
+// phase on a fresh compiler, and print one JSON object per phase.
+bool run_benchmark(const char *path, int iterations) {
+    BenchPhase phases[BENCH_PHASES] = {
+        [BENCH_READ]  = {.name = "read"},
+        [BENCH_LEX]   = {.name = "lex"},
+        [BENCH_PARSE] = {.name = "parse"},
+        [BENCH_OPTIMIZE] = {.name = "optimize"},
+        [BENCH_ASM]   = {.name = "asm"},
+        [BENCH_CODE]  = {.name = "code"},
+    };
+
+    for (int it = 0; it < iterations; it++) {
+        char *source;
+        size_t size;
+        bool mapped;
+
+        // Mapping a file is next to free, the pages fault in when first
+        // read. Touch them here so that's counted as reading.
+        long rss = rss_kb();
+        double start = now_seconds();
+        if (!read_file(path, &source, &size, &mapped)) {
+            return false;
+        }
+        fault_in(source, size);
+        bench_record(&phases[BENCH_READ], start, rss, 0, 0, size);
+
+        Compiler *c = compiler_new(source, size);
+        compiler_set_name(c, path);
+        rss = rss_kb();
+        start = now_seconds();
+        do {
+            lex(c);
+        } while (c->current_token.type != TOKEN_EOF);
+        bench_record(&phases[BENCH_LEX], start, rss, c->history.count, 0, size);
+        compiler_free(c);
+
+        c = compiler_new(source, size);
+        compiler_set_name(c, path);
+        rss = rss_kb();
+        start = now_seconds();
+        parse(c);
+        bench_record(&phases[BENCH_PARSE], start, rss, c->history.count,
+                     c->procedures.num, size);
+
+        rss = rss_kb();
+        start = now_seconds();
+        if (!optimize(c)) {
+            compiler_free(c);
+            release_file(source, size, mapped);
+            return false;
+        }
+        bench_record(&phases[BENCH_OPTIMIZE], start, rss, 0, c->procedures.num, 0);
+
+        rss = rss_kb();
+        start = now_seconds();
+        generate_code(c);
+        bench_record(&phases[BENCH_ASM], start, rss, 0, c->procedures.num,
+                     c->output.size);
+
+        rss = rss_kb();
+        start = now_seconds();
+        if (generate_machine_code(c)) {
+            bench_record(&phases[BENCH_CODE], start, rss, 0, c->procedures.num,
+                         c->code.size);
+        }
+
+        compiler_free(c);
+        release_file(source, size, mapped);
+    }
+
+    for (int i = 0; i < BENCH_PHASES; i++) {
+        BenchPhase *phase = &phases[i];
+        if (phase->total == 0) {
+            continue;
+        }
+        printf("{\"phase\": \"%s\", \"iterations\": %d, \"best_s\": %.9f, "
+               "\"mean_s\": %.9f, \"tokens\": %zu, \"procedures\": %zu, "
+               "\"bytes\": %zu, \"tokens_per_s\": %.0f, "
+               "\"procedures_per_s\": %.0f, \"bytes_per_s\": %.0f, "
+               "\"rss_delta_kb\": %ld}\n",
+               phase->name, iterations, phase->best, phase->total / iterations,
+               phase->tokens, phase->procedures, phase->bytes,
+               phase->tokens / phase->best, phase->procedures / phase->best,
+               phase->bytes / phase->best, phase->rss_delta_kb);
+    }
     return true;
 }
 
 int main(int argc, char *argv[]) {
     bool step_mode = false;
-    const char *source_file_name = NULL;
+    const char **source_file_names = malloc(argc * sizeof(char *));
+    size_t num_source_files = 0;
+    const char *asm_file_name = NULL; // Only emit assembly, to this path
+    bool emit_asm = false;            // Assemble with nasm and ld
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    long jobs = cpus;
+    int bench_iterations = 0;         // Benchmark instead of compiling
+    bool lsp_mode = false;            // Serve LSP over stdio
+    bool time_report = false;         // Print phase times to stderr
+    bool stats_report = false;        // Print counters to stderr
+    const char *stats_json = NULL;    // Write both as JSON here
+    long symbol_point = -1;           // --return-symbol-at
+    bool stream_mode = false;         // Compile in one pass as it parses
+    const char *tokens_dump = NULL;   // --dump-tokens, stop after parsing
+    const char *graph_dump = NULL;    // --dump-graph
+    bool dump_jsonl = false;          // JSON lines rather than binary
+    const char *tokens_replay = NULL; // --replay-tokens, step through a dump
     initThemes();
 
     // Parse command line arguments
-    if (argc == 3 &&
-        (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "--step") == 0)) {
-        step_mode = true;
-        source_file_name = argv[2];
-    } else if (argc == 2) {
-        source_file_name = argv[1];
-    } else {
-        fprintf(stderr, "Usage: %s [-s|--step] <source_file>\n", argv[0]);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--step") == 0) {
+            step_mode = true;
+        } else if (strcmp(argv[i], "--emit-asm") == 0) {
+            emit_asm = true;
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            asm_file_name = argv[++i];
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            jobs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-fno-omit-frame-pointer") == 0) {
+            keep_frame_pointer = true;
+        } else if (strcmp(argv[i], "-fomit-frame-pointer") == 0) {
+            keep_frame_pointer = false;
+        } else if (strcmp(argv[i], "--inline-threshold") == 0 && i + 1 < argc) {
+            inline_threshold = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--inline-budget") == 0 && i + 1 < argc) {
+            inline_budget = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            cache_path = argv[++i];
+        } else if (strcmp(argv[i], "--stack-report") == 0) {
+            stack_report = true;
+        } else if (strncmp(argv[i], "-O", 2) == 0) {
+            optimization_level = argv[i][2] ? atoi(argv[i] + 2) : 1;
+        } else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc) {
+            bench_iterations = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--time-report") == 0) {
+            time_report = collect_stats = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats_report = collect_stats = true;
+        } else if (strcmp(argv[i], "--stats-json") == 0 && i + 1 < argc) {
+            stats_json = argv[++i];
+            collect_stats = true;
+        } else if (strcmp(argv[i], "--continuous") == 0) {
+            continuous_redraw = true;
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            stream_mode = true;
+        } else if (strcmp(argv[i], "--dump-tokens") == 0 && i + 1 < argc) {
+            tokens_dump = argv[++i];
+        } else if (strcmp(argv[i], "--dump-graph") == 0 && i + 1 < argc) {
+            graph_dump = argv[++i];
+        } else if (strcmp(argv[i], "--dump-format") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "binary") == 0 ||
+                    strcmp(argv[i + 1], "jsonl") == 0)) {
+            dump_jsonl = strcmp(argv[++i], "jsonl") == 0;
+        } else if (strcmp(argv[i], "--lsp") == 0) {
+            lsp_mode = true;
+        } else if (strcmp(argv[i], "--replay-tokens") == 0 && i + 1 < argc) {
+            tokens_replay = argv[++i];
+        } else if (strcmp(argv[i], "--return-symbol-at") == 0 && i + 1 < argc) {
+            symbol_point = atol(argv[++i]);
+        } else {
+            source_file_names[num_source_files++] = argv[i];
+        }
+    }
+
+    codegen_jobs = jobs > 0 ? jobs : 1;
+    pipeline_lexer = cpus > 1; // On one core the lexer thread only takes turns
+
+    if (lsp_mode) {
+        free(source_file_names);
+        return run_language_server();
+    }
+
+    if (num_source_files == 0 ||
+        ((step_mode || bench_iterations > 0 || symbol_point >= 0 || stream_mode ||
+          tokens_dump) &&
+         num_source_files != 1)) {
+        fprintf(stderr,
+                "Usage: %s [-s|--step [--continuous] [--replay-tokens <file>]] [-O<level>] [-fno-omit-frame-pointer] "
+                "[--inline-threshold <calls>] [--inline-budget <percent>] "
+                "[--stack-report] [--cache <file>] [--stream] [--emit-asm] [-S <asm_file|->] [-j <jobs>] "
+                "[--time-report] [--stats] [--stats-json <file|->] "
+                "[--bench <iterations>] [--return-symbol-at <point>] "
+                "[--dump-tokens <file|->] [--dump-graph <file|->] "
+                "[--dump-format binary|jsonl] "
+                "<source_file|->...\n"
+                "       %s --lsp\n",
+                argv[0], argv[0]);
+        free(source_file_names);
         return 1;
     }
 
+    if (symbol_point >= 0) {
+        int status = return_symbol_at(source_file_names[0], symbol_point);
+        free(source_file_names);
+        return status;
+    }
+
+    if (stream_mode && !step_mode) {
+        bool ok = stream_file(source_file_names[0], asm_file_name, emit_asm);
+        free(source_file_names);
+        return ok ? 0 : 1;
+    }
+
+    if (bench_iterations > 0) {
+        bool ok = run_benchmark(source_file_names[0], bench_iterations);
+        free(source_file_names);
+        return ok ? 0 : 1;
+    }
+
+    if (!step_mode) {
+        // Parse every file, then generate code once for the whole program
+        SourceUnit *units = calloc(num_source_files, sizeof(SourceUnit));
+        for (size_t i = 0; i < num_source_files; i++) {
+            units[i].path = source_file_names[i];
+        }
+        free(source_file_names);
+
+        // Dumps and the stack report need the compiler, they aren't cached
+        Cache cache;
+        cache_init(&cache);
+        bool use_cache = cache_path && !tokens_dump && !graph_dump && !stack_report;
+        bool hit = false;
+        bool ok = true;
+        if (use_cache) {
+            ok = emit_cached(&cache, units, num_source_files, asm_file_name, emit_asm, &hit);
+        }
+
+        Compiler *c = NULL;
+        if (ok && !hit) {
+            c = compile_units(units, num_source_files, jobs > 0 ? jobs : 1);
+            ok = c != NULL;
+            if (tokens_dump || graph_dump) {
+                if (ok && tokens_dump) {
+                    ok = dump_tokens(c, tokens_dump, dump_jsonl);
+                }
+                if (ok && graph_dump) {
+                    ok = dump_graph(c, graph_dump, dump_jsonl);
+                }
+            } else {
+                ok = ok && emit_program(c, asm_file_name, emit_asm, use_cache ? &cache : NULL);
+            }
+        }
+
+        if (c && collect_stats) {
+            stats_add_compiler(c);
+            stats_add_program(c);
+        }
+        stats.cache_hits = cache.hits;
+        stats.cache_misses = cache.misses;
+        if (time_report || stats_report) {
+            stats_print(stderr, time_report, stats_report);
+        }
+        if (stats_json) {
+            ok = stats_write_json(stats_json) && ok;
+        }
+        if (c) {
+            compiler_free(c);
+        }
+        release_units(units, num_source_files);
+        cache_free(&cache);
+        return ok ? 0 : 1;
+    }
+
+    const char *source_file_name = source_file_names[0];
+    free(source_file_names);
+
     // Read source file
     char *source = NULL;
     size_t file_size = 0;
-    if (!read_file(source_file_name, &source, &file_size)) {
+    bool source_mapped = false;
+    if (!read_file(source_file_name, &source, &file_size, &source_mapped)) {
         return 1;
     }
 
     // Initialize compiler
-    Compiler *c = compiler_new(source);
+    Compiler *c = compiler_new(source, file_size);
     if (!c) {
         fprintf(stderr, "Error: Failed to initialize compiler\n");
-        free(source);
+        release_file(source, file_size, source_mapped);
         return 1;
     }
+    compiler_set_name(c, source_file_name);
 
-    if (step_mode) {
-        // Initialize window and input
-        initWindow(sw, sh, "imp - Lex Stepper");
-        registerKeyCallback(keyCallback);
+    // Step mode: initialize window and input
+    initWindow(sw, sh, "imp - Lex Stepper");
+    registerKeyCallback(keyCallback);
 
-        sw = getScreenWidth();  // NOTE Currently get screen dimentions
-        sh = getScreenHeight(); // only once at startup
+    sw = getScreenWidth();
+    sh = getScreenHeight();
 
-        // Load font
-        Font *font = loadFont(fontPath, fontsize, "fun");
-        if (!font) {
-            fprintf(stderr, "Failed to load font\n");
-            compiler_free(c);
-            free(source);
-            closeWindow();
-            return 1;
-        }
+    // Load font
+    Font *font = loadFont(fontPath, fontsize, "fun");
+    if (!font) {
+        fprintf(stderr, "Failed to load font\n");
+        compiler_free(c);
+        release_file(source, file_size, source_mapped);
+        closeWindow();
+        return 1;
+    }
 
-        lex(c); // Initialize the first token
+    if (tokens_replay) {
+        load_tokens(c, tokens_replay);
+    }
+    lex(c); // Initialize the first token
 
-        while (!windowShouldClose()) {
-            updateInput();
+    while (!windowShouldClose()) {
+        // Sleep until there is input, the timeout only bounds how long
+        // a missed resize stays on screen
+        if (!continuous_redraw && !needs_redraw) {
+            glfwWaitEventsTimeout(0.5);
+        }
+        updateInput();
 
-            beginDrawing();
-            clearBackground(CT.bg);
+        if (getScreenWidth() != sw || getScreenHeight() != sh) {
+            sw = getScreenWidth();
+            sh = getScreenHeight();
+            needs_redraw = true;
+        }
+        if (!continuous_redraw && !needs_redraw) {
+            continue;
+        }
+        needs_redraw = false;
 
+        bool finished = pending_move != MOVE_NONE && !applyMove(c);
 
-            drawCursor(c, font, 0, sh - font->ascent + font->descent, 0, 0, CT.cursor);
-            drawBuffer(c, font, 0, sh - font->ascent + font->descent, 0, 0);
-            drawCompilerState(font, c, step_count);
+        beginDrawing();
+        clearBackground(CT.bg);
 
-            if (should_step) {
-                if (c->current_token.type != TOKEN_EOF) {
-                    lex(c);
-                    step_count++;
-                } else {
-                    drawText(font, "Lexical analysis complete", 10, sh - 30, CT.region);
-                }
-                should_step = false;
-            }
+        followCursor(c, font);
+        drawCursor(c, font, 0, sh - font->ascent + font->descent, scrollX, scrollY, CT.cursor);
+        drawBuffer(c, font, 0, sh - font->ascent + font->descent, scrollX, scrollY);
+        drawCompilerState(font, c, step_count);
 
-            endDrawing();
+        if (finished) {
+            drawText(font, "Lexical analysis complete", 10, sh - 30, CT.region);
         }
 
-        freeFont(font);
-        closeWindow();
-    } else {
-        // Non-step mode: parse and generate code
-        parse(c);
-        generate_code(c);
-
-        // Assemble and link
-        int result = system("nasm -f elf64 output.asm && ld -o a.out output.o");
-        if (result == 0) {
-            printf("Compilation successful. Executable 'a.out' created.\n");
-        } else {
-            fprintf(stderr, "Error: Compilation failed\n");
-        }
+        endDrawing();
     }
 
+    freeFont(font);
+    closeWindow();
+
     // Cleanup
     compiler_free(c);
-    free(source);
+    release_file(source, file_size, source_mapped);
 
     return 0;
 }